@@ -55,11 +55,16 @@ void init_devices(void)
  MCUCR = 0x00;
 }
 
+//test pattern for the file written by main, 0 to 255 over and over
+unsigned char nextTestByte(void)
+{
+    static unsigned char value = 0;
+    return value++;
+}
+
 int main(void)
 {
-    unsigned char fileName[20];
     unsigned char progname[FNAMELEN];
-    unsigned char tmp[50];
     unsigned char rdchar,rdbus,tmp1,tmp2,ctl;
     unsigned char option, error, data, FAT32_active;
     unsigned char getting_filename;
@@ -76,7 +81,6 @@ int main(void)
 
     struct dir_Structure *dir;
     unsigned long cluster, byteCounter = 0, fileSize, firstSector;
-    unsigned int k;
     unsigned char j,sending;
     unsigned char response;
     unsigned char startline;
@@ -95,7 +99,7 @@ int main(void)
     getting_filename = 0;
     filename_position = 0;
     
-    transmitString("initialize card");
+    transmitString_F((char *)PSTR("initialize card"));
 
     // initialize SD card
     for (i=0; i<10; i++)
@@ -106,7 +110,7 @@ int main(void)
     
     if (!error)
     {
-        transmitString("card initialized.");
+        transmitString_F((char *)PSTR("card initialized."));
         error = getBootSectorData (); //read boot sector and keep necessary data in global variables
     
         /*
@@ -121,15 +125,12 @@ int main(void)
         openFileForReading(progname, _rootCluster);
         while (_filePosition.byteCounter < _filePosition.fileSize)
         {
-            getNextFileBlock();
-            for (k = 0; k < 512; k++)
-            {
-                transmitByte(_buffer[k]);
-            }
+            // each byte goes out as it comes off the card
+            getNextFileBlockToSink(transmitByte);
         }
         
-        transmitString("\r\n");
-        transmitString("done reading file\r\n");
+        transmitString_F((char *)PSTR("\r\n"));
+        transmitString_F((char *)PSTR("done reading file\r\n"));
         */
         
         
@@ -141,15 +142,15 @@ int main(void)
         progname[4] = '*';
         progname[5] = 0;
         dir = findFile(progname, _rootCluster);
-        transmitString("I am back");
+        transmitString_F((char *)PSTR("I am back"));
         
         if (dir != 0)
         {
             dirCluster = getFirstCluster(dir);
             
-            transmitString("dirCluster ");
+            transmitString_F((char *)PSTR("dirCluster "));
             transmitHex(LONG, dirCluster);
-            transmitString("\r\n");
+            transmitString_F((char *)PSTR("\r\n"));
         }
         
         
@@ -174,22 +175,21 @@ int main(void)
             //progname[6] = 'A' + i;
             openFileForWriting(progname, dirCluster);
             
-            transmitString("writing..\r\n");
+            transmitString_F((char *)PSTR("writing..\r\n"));
             for (j = 0; j < 16; j++)
             {
-                for (k = 0; k < 512; k++)
-                {
-                    _buffer[k] = k % 256;
-                }
-                writeBufferToFile(512);
+                // each byte is made as it goes to the card
+                writeSourceToFile(nextTestByte, 512);
             }
             closeFile();
         }
         
+        // FSinfo is kept in RAM until here
+        unmountCard();
     }
     else
     {
-        transmitString("no card found.");
+        transmitString_F((char *)PSTR("no card found."));
     }
     
     while(1)
@@ -26,6 +26,7 @@
 
 #include <avr/io.h>
 #include <avr/pgmspace.h>
+#include "SPI_routines.h"
 #include "FAT32.h"
 #include "UART_routines.h"
 #include "SD_routines.h"
@@ -45,6 +46,15 @@ unsigned char getBootSectorData (void)
     unsigned long dataSectors;
 
     _unusedSectors = 0;
+#if FAT_CACHE
+    _fatBufferSector = 0;
+#else
+    _fatWindowSector = 0;
+#endif
+    _fatBufferDirty = 0;
+    invalidateNameIndex(0);
+    invalidateDentryCache(0);
+    _dirHintStart = 0;
 
     SD_readSingleBlock(0);
     bpb = (struct BS_Structure *)_buffer;
@@ -74,7 +84,18 @@ unsigned char getBootSectorData (void)
                   - ( bpb->numberofFATs * bpb->FATsize_F32);
     _totalClusters = dataSectors / _sectorPerCluster;
 
-    if((getSetFreeCluster (TOTAL_FREE, GET, 0)) > _totalClusters)  //check if FSinfo free clusters count is valid
+    //size the groups of the free space summary so the whole FAT is covered
+    _freeMapShift = 0;
+    while(((bpb->FATsize_F32 - 1) >> _freeMapShift) >= FREE_MAP_BYTES * 8)
+        _freeMapShift++;
+    memset((void *)_freeMap, 0, FREE_MAP_BYTES);
+
+    //FSinfo is read once here and kept in RAM until syncFSInfo; nothing
+    //is held in _buffer yet, so both fields come from one read
+    _fsInfoDirty = 0;
+    SD_readSingleBlock(_unusedSectors + 1);
+    _freeClusterCount = getSetFreeCluster (TOTAL_FREE, GET, 0);
+    if(_freeClusterCount > _totalClusters)  //check if FSinfo free clusters count is valid
     {
          _freeClusterCountUpdated = 0;
     }
@@ -82,6 +103,13 @@ unsigned char getBootSectorData (void)
     {
     	 _freeClusterCountUpdated = 1;
     }
+
+    //the FSinfo next free cluster is only a hint, use it when it is in range
+    _nextFreeCluster = getSetFreeCluster (NEXT_FREE, GET, 0);
+    if(_nextFreeCluster < 2 || _nextFreeCluster >= _totalClusters)
+    {
+         _nextFreeCluster = _rootCluster;
+    }
     return 0;
 }
 
@@ -96,6 +124,58 @@ unsigned long getFirstSector(unsigned long clusterNumber)
   return (((clusterNumber - 2) * _sectorPerCluster) + _firstDataSector);
 }
 
+//***************************************************************************
+//Function: to bring a FAT sector into the FAT cache, writing back the sector
+//it held before if that one was modified; without FAT_CACHE the sector is
+//read into _buffer
+//Arguments: sector number of the FAT sector
+//return: 0 if the sector is in the cache, otherwise the SD error response
+//***************************************************************************
+unsigned char loadFATSector (unsigned long sector)
+{
+    unsigned char response = 0;
+    unsigned char retry = 0;
+
+    if (sector == _fatBufferSector)
+        return 0;
+
+    flushFATCache();
+
+    while(retry < 10)
+    {
+        response = SD_waitRequest(SD_submitRead(sector, (unsigned char *)_fatBuffer));
+        if(!response) break;
+        retry++;
+    }
+
+#if FAT_CACHE
+    _fatBufferSector = response ? 0 : sector;
+#endif
+    return response;
+}
+
+//***************************************************************************
+//Function: to write the cached FAT sector back to the card if it was modified;
+//called on closeFile, and by the application to sync the FAT
+//Arguments: none
+//return: none
+//***************************************************************************
+void flushFATCache (void)
+{
+    unsigned char handle;
+
+    if (!_fatBufferDirty)
+        return;
+
+    handle = SD_submitWrite(_fatBufferSector, (unsigned char *)_fatBuffer);
+
+    // _fatBuffer must not change until the card has taken the data
+    while (SD_requestState(handle) == SD_REQ_PENDING)
+        SD_poll();
+
+    _fatBufferDirty = 0;
+}
+
 //***************************************************************************
 //Function: get cluster entry value from FAT to find out the next cluster in the chain
 //or set new cluster entry in FAT
@@ -110,7 +190,6 @@ unsigned long getSetNextCluster (unsigned long clusterNumber,
     unsigned int FATEntryOffset;
     unsigned long *FATEntryValue;
     unsigned long FATEntrySector;
-    unsigned char retry = 0;
 
     //get sector number of the cluster entry in the FAT
     FATEntrySector = _unusedSectors + _reservedSectorCount + ((clusterNumber * 4) / _bytesPerSector) ;
@@ -118,25 +197,110 @@ unsigned long getSetNextCluster (unsigned long clusterNumber,
     //get the offset address in that sector number
     FATEntryOffset = (unsigned int) ((clusterNumber * 4) % _bytesPerSector);
 
-    //read the sector into a buffer
-    while(retry < 10)
-    { 
-        if(!SD_readSingleBlock(FATEntrySector)) break; retry++;
+#if !FAT_CACHE
+    //a get only needs the entry, it is read with its neighbours into the
+    //window so _buffer is kept and a multiple block write isn't stopped for
+    //every cluster
+    if(get_set == GET && FATEntrySector != _bufferBlock)
+    {
+        if(FATEntrySector != _fatWindowSector
+           || (FATEntryOffset & ~(FAT_WINDOW_BYTES - 1)) != _fatWindowOffset)
+        {
+            _fatWindowSector = 0;
+            _fatWindowOffset = FATEntryOffset & ~(FAT_WINDOW_BYTES - 1);
+            if(SD_readWindow(FATEntrySector, _fatWindowOffset, FAT_WINDOW_BYTES, (unsigned char *)_fatWindow))
+              return 0x0fffffff;   //taken as the end of the chain
+            _fatWindowSector = FATEntrySector;
+        }
+        return ((*(unsigned long *) &_fatWindow[FATEntryOffset - _fatWindowOffset]) & 0x0fffffff);
     }
+#endif
+
+    //bring the sector into the FAT cache, one that can't be read is left alone
+    if(loadFATSector(FATEntrySector))
+      return (get_set == GET) ? 0x0fffffff : 0;
 
-    //get the cluster address from the buffer
-    FATEntryValue = (unsigned long *) &_buffer[FATEntryOffset];
+    //get the cluster address from the cache
+    FATEntryValue = (unsigned long *) &_fatBuffer[FATEntryOffset];
 
     if(get_set == GET)
       return ((*FATEntryValue) & 0x0fffffff);
 
     *FATEntryValue = clusterEntry;   //for setting new value in cluster entry in FAT
 
-    SD_writeSingleBlock(FATEntrySector);
+    _fatBufferDirty = 1;   //written back when the cache moves to another sector
+
+#if !FAT_CACHE
+    if(FATEntrySector == _fatWindowSector && (FATEntryOffset & ~(FAT_WINDOW_BYTES - 1)) == _fatWindowOffset)
+        *(unsigned long *) &_fatWindow[FATEntryOffset - _fatWindowOffset] = clusterEntry;
+#endif
+
+    if(clusterEntry == 0)
+    {
+        //cluster freed, its group of FAT sectors has free space again
+        clusterNumber = (clusterNumber / 128) >> _freeMapShift;
+        _freeMap[clusterNumber / 8] &= ~(1 << (clusterNumber % 8));
+    }
 
     return (0);
 }
 
+//***************************************************************************
+//Function: to extend the extent table of the file being read. The chain is
+//followed through every entry of the loaded FAT sector that belongs to it,
+//and further sectors are loaded until the last extent is known to end. When
+//the table is full, extents before the current one make room
+//Arguments: none
+//return: none
+//***************************************************************************
+void mapFileExtents (void)
+{
+    unsigned long cluster, FATEntrySector;
+    unsigned char i, loaded = 0;
+    file_extent *extents = (file_extent *)_filePosition.extents;
+    file_extent *last;
+
+    while(_filePosition.mappedNext >= 2 && _filePosition.mappedNext < 0x0ffffff8)
+    {
+        cluster = _filePosition.mappedNext;
+        FATEntrySector = _unusedSectors + _reservedSectorCount + ((cluster * 4) / _bytesPerSector);
+        last = (_filePosition.extentCount > 0) ? &extents[_filePosition.extentCount - 1] : 0;
+
+        if(last != 0 && cluster == last->cluster + last->length)
+        {
+            last->length++;
+        }
+        else
+        {
+            //a new extent, only decode it now if its FAT entry is at hand
+            if(loaded && FATEntrySector != _fatBufferSector)
+                break;
+
+            if(_filePosition.extentCount == MAX_EXTENTS)
+            {
+                if(_filePosition.extentIndex == 0)
+                    break;
+
+                //drop the oldest extent
+                _filePosition.extentBase += extents[0].length;
+                for(i = 1; i < MAX_EXTENTS; i++)
+                    extents[i - 1] = extents[i];
+                _filePosition.extentCount--;
+                _filePosition.extentIndex--;
+            }
+
+            extents[_filePosition.extentCount].cluster = cluster;
+            extents[_filePosition.extentCount].length = 1;
+            _filePosition.extentCount++;
+        }
+
+        loadFATSector(FATEntrySector);
+        loaded = 1;
+
+        _filePosition.mappedNext = (*(unsigned long *) &_fatBuffer[(cluster * 4) % _bytesPerSector]) & 0x0fffffff;
+    }
+}
+
 //********************************************************************************************
 //Function: to get or set next free cluster or total free clusters in FSinfo sector of SD card
 //Arguments: 1.flag:TOTAL_FREE or NEXT_FREE, 
@@ -150,7 +314,8 @@ unsigned long getSetFreeCluster(unsigned char totOrNext, unsigned char get_set,
 {
     struct FSInfo_Structure *FS = (struct FSInfo_Structure *) &_buffer;
     
-    SD_readSingleBlock(_unusedSectors + 1);
+    if (_bufferBlock != _unusedSectors + 1)
+        SD_readSingleBlock(_unusedSectors + 1);
 
     if((FS->leadSignature != 0x41615252) || (FS->structureSignature != 0x61417272) || (FS->trailSignature !=0xaa550000))
       return 0xffffffff;
@@ -230,6 +395,10 @@ unsigned char numCharsToCompare(unsigned char *fileName, unsigned char maxChars)
 
 void openDirectory(unsigned long firstCluster)
 {
+    // list full names, findFile sets a name to match after this
+    _lfnTarget = 0;
+    _lfnTargetLength = 0;
+    
     // store cluster
     _filePosition.startCluster = firstCluster;
     _filePosition.cluster = firstCluster;
@@ -248,18 +417,44 @@ void deleteFile()
     
     byte = _filePosition.byteCounter-32;
     dir = (struct dir_Structure *) &_buffer[byte];
-    dir->name[0] = EMPTY;
+    dir->name[0] = DELETED;   //the entries after it stay in the directory
     SD_writeSingleBlock(sector);
+    
+    _appendStartCluster = 0;   //the cached tail may belong to this file
+    invalidateNameIndex(0);
+    invalidateDentryCache(getFirstCluster(dir));
+    
+    // the entry can be reused, unless a free entry in front of it in the
+    // same cluster is known; the end of the directory stays where it is
+    if (_filePosition.startCluster == _dirHintStart)
+    {
+        if (_dirFreeCluster != _filePosition.cluster
+            || ((unsigned int)_dirFreeSector * _bytesPerSector + _dirFreeEntry)
+               > ((unsigned int)_filePosition.sectorIndex * _bytesPerSector + byte))
+        {
+            _dirFreeCluster = _filePosition.cluster;
+            _dirFreeSector = _filePosition.sectorIndex;
+            _dirFreeEntry = byte;
+            _dirFreeLength = 1;
+        }
+    }
+    else if (getFirstCluster(dir) == _dirHintStart)
+    {
+        _dirHintStart = 0;
+    }
 }
 
+//offsets of the 13 characters in a long name directory entry
+const unsigned char lfnCharOffset[13] PROGMEM = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
 struct dir_Structure *getNextDirectoryEntry()
 {
-    unsigned long firstSector;
+    unsigned long firstSector, sector;
     struct dir_Structure *dir;
     struct dir_Longentry_Structure *longent;
     unsigned char ord;
-    unsigned char this_long_filename_length;
-    unsigned char k;
+    unsigned int this_long_filename_length;
+    unsigned char k, c;
     
     // reset long entry info
     memset((void *)_longEntryString, 0, MAX_FILENAME);
@@ -272,7 +467,19 @@ struct dir_Structure *getNextDirectoryEntry()
         
         for (; _filePosition.sectorIndex < _sectorPerCluster; _filePosition.sectorIndex++)
         {
-            SD_readSingleBlock(firstSector + _filePosition.sectorIndex);
+            sector = firstSector + _filePosition.sectorIndex;
+            
+            // the sector stays in the buffer between calls unless something
+            // else used it, the rest of the cluster is read as one transfer
+            if (sector != _bufferBlock)
+            {
+                if (_streamMode != STREAM_READ || _startBlock != sector)
+                {
+                    SD_readMultipleBlock(sector, _sectorPerCluster - _filePosition.sectorIndex);
+                }
+                SD_readNextBlock();
+            }
+            
             for (; _filePosition.byteCounter < _bytesPerSector; _filePosition.byteCounter += 32)
             {
                 // get current directory entry
@@ -286,33 +493,54 @@ struct dir_Structure *getNextDirectoryEntry()
                 // this is a valid file entry
                 if((dir->name[0] != DELETED) && (dir->attrib != ATTR_LONG_NAME))
                 {
+                    // a long name only belongs to the entry it was made for
+                    if (_filePosition.isLongFilename == 1 && ChkSum(dir->name) != _lfnChecksum)
+                    {
+                        _filePosition.isLongFilename = 0;
+                        _lfnMatch = 0;
+                    }
+                    
                     _filePosition.byteCounter += 32;
                     return dir;
                 }
-                else if (dir->attrib == ATTR_LONG_NAME)
+                else if (dir->name[0] != DELETED)
                 {
-                    _filePosition.isLongFilename = 1;
-                    
                     longent = (struct dir_Longentry_Structure *) &_buffer[_filePosition.byteCounter];
                     
-                    ord = (longent->LDIR_Ord & 0x0F) - 1;
+                    ord = (longent->LDIR_Ord & 0x1F) - 1;
                     this_long_filename_length = (13*ord);
                     
-                    for (k = 0; k < 5; k++)
+                    // the last part of a name comes first
+                    if (longent->LDIR_Ord & 0x40)
                     {
-                        _longEntryString[this_long_filename_length] = (unsigned char)longent->LDIR_Name1[k];
-                        this_long_filename_length++;
+                        memset((void *)_longEntryString, 0, MAX_FILENAME);
+                        _filePosition.isLongFilename = 1;
+                        _lfnChecksum = longent->LDIR_Chksum;
+                        
+                        // too short for the name looked for
+                        _lfnMatch = (this_long_filename_length + 13 >= _lfnTargetLength);
                     }
-                    
-                    for (k = 0; k < 6; k++)
+                    else if (longent->LDIR_Chksum != _lfnChecksum)
                     {
-                        _longEntryString[this_long_filename_length] = (unsigned char)longent->LDIR_Name2[k];
-                        this_long_filename_length++;
+                        // part of another name
+                        _filePosition.isLongFilename = 0;
+                        _lfnMatch = 0;
                     }
                     
-                    for (k = 0; k < 2; k++)
+                    // a part that already mismatches the name looked for
+                    // leaves the rest of the name alone
+                    for (k = 0; k < 13 && _filePosition.isLongFilename == 1 && (_lfnTarget == 0 || _lfnMatch == 1); k++)
                     {
-                        _longEntryString[this_long_filename_length] = (unsigned char)longent->LDIR_Name3[k];
+                        c = ((unsigned char *)longent)[pgm_read_byte(&lfnCharOffset[k])];
+                        
+                        if (_lfnTarget != 0 && this_long_filename_length < _lfnTargetLength
+                            && (c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c) != _lfnTarget[this_long_filename_length])
+                        {
+                            _lfnMatch = 0;
+                        }
+                        
+                        if (this_long_filename_length < MAX_FILENAME - 1)
+                            _longEntryString[this_long_filename_length] = c;
                         this_long_filename_length++;
                     }
                 }
@@ -375,6 +603,25 @@ void convertToShortFilename(unsigned char *input, unsigned char *output)
 }
 
 struct dir_Structure* findFile (unsigned char *fileName, unsigned long firstCluster)
+{
+    struct dir_Structure *dir;
+    
+    dir = findFileEntry(fileName, firstCluster);
+    
+    // the name looked for belongs to the caller, don't keep pointing at it
+    _lfnTarget = 0;
+    _lfnTargetLength = 0;
+    
+    return dir;
+}
+
+//***************************************************************************
+//Function: to look for a file or directory in a directory, see findFile;
+//leaves _lfnTarget set
+//Arguments: #1.name, may end in '*' #2.first cluster of the directory
+//return: the directory entry in _buffer, 0 if not found
+//***************************************************************************
+struct dir_Structure* findFileEntry (unsigned char *fileName, unsigned long firstCluster)
 {
     struct dir_Structure *dir;
     unsigned char cmp_long_fname;
@@ -383,6 +630,11 @@ struct dir_Structure* findFile (unsigned char *fileName, unsigned long firstClus
     unsigned char *findFileStr;
     unsigned char maxChars;
     int result;
+#if NAME_INDEX_SIZE
+    unsigned int hash, slot, ordinal;
+    unsigned long cluster;
+    unsigned char sectorIndex, entry;
+#endif
     
     cmp_long_fname = isLongFilename(fileName);
     
@@ -400,8 +652,61 @@ struct dir_Structure* findFile (unsigned char *fileName, unsigned long firstClus
     }
     
     cmp_length = numCharsToCompare(findFileStr, maxChars);
+    
+#if NAME_INDEX_SIZE
+    if (firstCluster != _nameIndexDir)
+    {
+        invalidateNameIndex(firstCluster);
+    }
+    
+    // names without a wildcard are looked up in the index first
+    if (cmp_long_fname == 1 ? findFileStr[cmp_length] == 0 : cmp_length == 11)
+    {
+        hash = nameHash(findFileStr, cmp_length < NAME_HASH_LENGTH ? cmp_length : NAME_HASH_LENGTH);
+        _lfnTarget = cmp_long_fname ? findFileStr : 0;
+        _lfnTargetLength = cmp_long_fname ? cmp_length : 0;
+        
+        for (slot = hash & (NAME_INDEX_SIZE - 1); _nameIndex[slot].hash != 0; slot = (slot + 1) & (NAME_INDEX_SIZE - 1))
+        {
+            if (_nameIndex[slot].hash != hash)
+                continue;
+            
+            _filePosition.startCluster = firstCluster;
+            _filePosition.cluster = _nameIndex[slot].cluster;
+            _filePosition.sectorIndex = _nameIndex[slot].sectorIndex;
+            _filePosition.byteCounter = _nameIndex[slot].entry * 32;
+            dir = getNextDirectoryEntry();
+            if (dir == 0)
+                continue;
+            
+            if (cmp_long_fname == 1)
+            {
+                if (_filePosition.isLongFilename == 1 && _lfnMatch == 1)
+                    return dir;
+            }
+            else if (strncmp((char *)findFileStr, (char *)dir->name, cmp_length) == 0)
+            {
+                return dir;
+            }
+        }
+        
+        // a short name not in a complete index isn't in the directory, a long
+        // name may still match the start of a longer one
+        if (cmp_long_fname == 0 && _nameIndexComplete == 1)
+            return 0;
+    }
+    ordinal = 0;
+#endif
+    
     openDirectory(firstCluster);
     
+    // long names are matched part by part as the entries are read
+    if (cmp_long_fname == 1)
+    {
+        _lfnTarget = findFileStr;
+        _lfnTargetLength = cmp_length;
+    }
+    
     /*
     transmitString(findFileStr);
     TX_NEWLINE;
@@ -413,20 +718,66 @@ struct dir_Structure* findFile (unsigned char *fileName, unsigned long firstClus
      
     do
     {
+#if NAME_INDEX_SIZE
+        cluster = _filePosition.cluster;
+        sectorIndex = _filePosition.sectorIndex;
+        entry = _filePosition.byteCounter / 32;
+        
+        // an entry going into the index needs its whole long name
+        if (cmp_long_fname == 1)
+            _lfnTarget = (ordinal == _nameIndexEntries && _nameIndexFull == 0) ? 0 : findFileStr;
+#endif
         dir = getNextDirectoryEntry();
         
         if (dir == 0)
         {
+#if NAME_INDEX_SIZE
+            if (_nameIndexFull == 0)
+                _nameIndexComplete = 1;
+#endif
             // file not found
             return 0;
         }
         
-        if (cmp_long_fname == 1)
+#if NAME_INDEX_SIZE
+        // entries past the ones indexed by earlier scans go into the index
+        if (ordinal++ == _nameIndexEntries && _nameIndexFull == 0)
         {
+            addToNameIndex(nameHash(dir->name, 11), cluster, sectorIndex, entry);
             if (_filePosition.isLongFilename == 1)
+                addToNameIndex(nameHash(_filePosition.fileName, NAME_HASH_LENGTH), cluster, sectorIndex, entry);
+            if (_nameIndexFull == 0)
+                _nameIndexEntries++;
+        }
+#endif
+        
+        if (cmp_long_fname == 1)
+        {
+            if (_filePosition.isLongFilename == 1 && _lfnTarget != 0)
+            {
+                if (_lfnMatch == 1)
+                {
+                    return dir;
+                }
+            }
+            else if (_filePosition.isLongFilename == 1)
             {
                 ustr = (unsigned char *)strupr((char *)_filePosition.fileName);
-                result = strncmp((char *)findFileStr, (char *)ustr, cmp_length);
+                result = strncmp((char *)findFileStr, (char *)ustr,
+                                 cmp_length < NAME_HASH_LENGTH ? cmp_length : NAME_HASH_LENGTH);
+#if NAME_INDEX_SIZE
+                // past the part kept in RAM the name is compared part by
+                // part, the entry is read again for that
+                if (result == 0 && cmp_length > NAME_HASH_LENGTH)
+                {
+                    _filePosition.cluster = cluster;
+                    _filePosition.sectorIndex = sectorIndex;
+                    _filePosition.byteCounter = entry * 32;
+                    _lfnTarget = findFileStr;
+                    dir = getNextDirectoryEntry();
+                    result = (dir != 0 && _filePosition.isLongFilename == 1 && _lfnMatch == 1) ? 0 : 1;
+                }
+#endif
                 
                 /*
                 transmitString(ustr);
@@ -464,141 +815,1206 @@ struct dir_Structure* findFile (unsigned char *fileName, unsigned long firstClus
     return 0;
 }
 
-unsigned long getFirstCluster(struct dir_Structure *dir)
-{
-    return (((unsigned long) dir->firstClusterHI) << 16) | dir->firstClusterLO;
-}
-
-unsigned char openFileForReading(unsigned char *fileName, unsigned long dirCluster)
+//***************************************************************************
+//Function: to hash a file name for the name index, case is ignored
+//Arguments: #1.name #2.its maximum length, it may end earlier with a 0
+//return: the hash, never 0
+//***************************************************************************
+unsigned int nameHash (unsigned char *name, unsigned char length)
 {
-    struct dir_Structure *dir;
+    unsigned int hash = 0;
+    unsigned char c;
     
-    dir = findFile(fileName, dirCluster);
-    if (dir == 0)
+    while (length-- > 0 && (c = *name++) != 0)
     {
-        return 0;
+        if (c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+        hash = hash * 31 + c;
     }
     
-    _filePosition.fileSize = dir->fileSize;
-    _filePosition.startCluster = getFirstCluster(dir);
-    
-    _filePosition.cluster = _filePosition.startCluster;
-    _filePosition.byteCounter = 0;
-    _filePosition.sectorIndex = 0;
-    _filePosition.dirStartCluster = dirCluster;
-    
-    return 1;
+    return (hash == 0) ? 1 : hash;
 }
 
-unsigned int getNextFileBlock()
+//***************************************************************************
+//Function: to add the location of a directory entry to the name index,
+//open addressing with one slot always kept free to end the lookups
+//Arguments: #1.name hash #2-4.directory cursor in front of the entry
+//return: none
+//***************************************************************************
+void addToNameIndex (unsigned int hash, unsigned long cluster, unsigned char sectorIndex, unsigned char entry)
 {
-    unsigned long sector;
+#if NAME_INDEX_SIZE
+    unsigned int slot;
     
-    // if cluster has no more sectors, move to next cluster
-    if (_filePosition.sectorIndex == _sectorPerCluster)
+    if (_nameIndexUsed >= NAME_INDEX_SIZE - 1)
     {
-        _filePosition.sectorIndex = 0;
-        _filePosition.cluster = getSetNextCluster(_filePosition.cluster, GET, 0);
+        _nameIndexFull = 1;
+        return;
     }
     
-    sector = getFirstSector(_filePosition.cluster) + _filePosition.sectorIndex;
-    
-    SD_readSingleBlock(sector);
-    _filePosition.byteCounter += 512;
-    _filePosition.sectorIndex++;
-    
-    if (_filePosition.byteCounter > _filePosition.fileSize)
-    {
-        return _filePosition.fileSize - (_filePosition.byteCounter - 512);
-    }
-    else
-    {
-        return 512;
-    }
+    slot = hash & (NAME_INDEX_SIZE - 1);
+    while (_nameIndex[slot].hash != 0)
+        slot = (slot + 1) & (NAME_INDEX_SIZE - 1);
     
+    _nameIndex[slot].hash = hash;
+    _nameIndex[slot].cluster = cluster;
+    _nameIndex[slot].sectorIndex = sectorIndex;
+    _nameIndex[slot].entry = entry;
+    _nameIndexUsed++;
+#else
+    (void)hash;
+    (void)cluster;
+    (void)sectorIndex;
+    (void)entry;
+#endif
 }
 
-// open a new file for writing
-void openFileForWriting(unsigned char *fileName, unsigned long dirCluster)
+//***************************************************************************
+//Function: to empty the name index, whenever entries of the indexed
+//directory are added or removed
+//Arguments: first cluster of the directory to index next, 0 for none
+//return: none
+//***************************************************************************
+void invalidateNameIndex (unsigned long dirCluster)
 {
-    unsigned long cluster;
-    unsigned char i;
+#if NAME_INDEX_SIZE
+    memset((void *)_nameIndex, 0, sizeof(_nameIndex));
+    _nameIndexDir = dirCluster;
+    _nameIndexUsed = 0;
+    _nameIndexEntries = 0;
+    _nameIndexComplete = 0;
+    _nameIndexFull = 0;
+#else
+    (void)dirCluster;
+#endif
+}
+
+//***************************************************************************
+//Function: to look up a name in the dentry cache and make it the most
+//recently used entry
+//Arguments: #1.first cluster of the directory holding the name #2.the
+//name in upper case #3.set to the attributes of its entry
+//return: first cluster of the name, 0 if not cached
+//***************************************************************************
+unsigned long lookupDentry (unsigned long parent, unsigned char *name, unsigned char *attrib)
+{
+#if DENTRY_CACHE_SIZE
+    unsigned char i, hit;
     
-    // use existing buffer for filename
-    _filePosition.fileName = (unsigned char *)_longEntryString;
-    memset(_filePosition.fileName, 0, MAX_FILENAME);
-    //strcpy(_filePosition.fileName, fileName);
+    // longer names are never cached
+    if (strlen((char *)name) > DENTRY_NAME_LENGTH)
+        return 0;
     
-    i = 0;
-    while (fileName[i] != 0)
+    hit = DENTRY_CACHE_SIZE;
+    for (i = 0; i < DENTRY_CACHE_SIZE; i++)
     {
-        transmitHex(CHAR, i);
-        _filePosition.fileName[i] = fileName[i];
-        i++;
+        if (_dentryCache[i].parent == parent
+            && strncmp((char *)_dentryCache[i].name, (char *)name, DENTRY_NAME_LENGTH) == 0)
+            hit = i;
+        else if (_dentryCache[i].age < 0xff)
+            _dentryCache[i].age++;
     }
-
-    memset((void *)_filePosition.shortFilename, 0, 11);
     
-    // find the start cluster for this file
-    cluster = getSetFreeCluster(NEXT_FREE, GET, 0);
-    if (cluster > _totalClusters)
+    if (hit < DENTRY_CACHE_SIZE)
     {
-        cluster = _rootCluster;
+        _dentryCache[hit].age = 0;
+        *attrib = _dentryCache[hit].attrib;
+        return _dentryCache[hit].cluster;
     }
+#else
+    (void)parent;
+    (void)name;
+    (void)attrib;
+#endif
+    return 0;
+}
+
+//***************************************************************************
+//Function: to put a name into the dentry cache in place of the least
+//recently used entry
+//Arguments: #1-2.as for lookupDentry #3.first cluster of the name #4.the
+//attributes of its entry
+//return: none
+//***************************************************************************
+void addDentry (unsigned long parent, unsigned char *name, unsigned long cluster, unsigned char attrib)
+{
+#if DENTRY_CACHE_SIZE
+    unsigned char i, oldest;
     
-    // set the start cluster with EOF
-    cluster = searchNextFreeCluster(cluster);
+    if (strlen((char *)name) > DENTRY_NAME_LENGTH)
+        return;
     
-    getSetNextCluster(cluster, SET, EOF);   //last cluster of the file, marked EOF
+    oldest = 0;
+    for (i = 0; i < DENTRY_CACHE_SIZE; i++)
+    {
+        if (_dentryCache[i].parent == 0)
+        {
+            oldest = i;
+            break;
+        }
+        if (_dentryCache[i].age > _dentryCache[oldest].age)
+            oldest = i;
+    }
     
-    _filePosition.startCluster = cluster;
-    _filePosition.cluster = cluster;
-    _filePosition.fileSize = 0;
-    _filePosition.sectorIndex = 0;
-    _filePosition.dirStartCluster = dirCluster;
+    _dentryCache[oldest].parent = parent;
+    strncpy((char *)_dentryCache[oldest].name, (char *)name, DENTRY_NAME_LENGTH);
+    _dentryCache[oldest].cluster = cluster;
+    _dentryCache[oldest].attrib = attrib;
+    _dentryCache[oldest].age = 0;
+#else
+    (void)parent;
+    (void)name;
+    (void)cluster;
+    (void)attrib;
+#endif
 }
 
-void writeBufferToFile(unsigned int bytesToWrite)
+//***************************************************************************
+//Function: to drop the dentry cache entries of a directory, whenever its
+//entries are added or removed or it is deleted itself
+//Arguments: first cluster of the directory, 0 to empty the cache
+//return: none
+//***************************************************************************
+void invalidateDentryCache (unsigned long dirCluster)
 {
-    unsigned long nextCluster;
-    unsigned long sector;
-    // write a block to current file
-    sector = getFirstSector(_filePosition.cluster) + _filePosition.sectorIndex;
-    
-    SD_writeSingleBlock(sector);
-    _filePosition.fileSize += bytesToWrite;
-    _filePosition.sectorIndex++;
+#if DENTRY_CACHE_SIZE
+    unsigned char i;
     
-    if (_filePosition.sectorIndex == _sectorPerCluster)
+    for (i = 0; i < DENTRY_CACHE_SIZE; i++)
     {
-        _filePosition.sectorIndex = 0;
-        // get the next free cluster
-        nextCluster = searchNextFreeCluster(_filePosition.cluster);
-        // link the previous cluster
-        getSetNextCluster(_filePosition.cluster, SET, nextCluster);
-        // set the last cluster with EOF
-        getSetNextCluster(nextCluster, SET, EOF);
-        _filePosition.cluster = nextCluster;
+        if (dirCluster == 0 || _dentryCache[i].parent == dirCluster || _dentryCache[i].cluster == dirCluster)
+            _dentryCache[i].parent = 0;
     }
+#else
+    (void)dirCluster;
+#endif
 }
 
-/*
-void printFileInfo()
+//***************************************************************************
+//Function: to find the directory holding the last name of a path like
+//"/logs/2026/run.bin", starting from the root directory. Directories on the
+//way are taken from the dentry cache when they are in it, so only the ones
+//not cached yet are searched for in their parent. The path is left as it is
+//Arguments: #1.path, names separated by '/' #2.MAX_FILENAME bytes, set to
+//the last name in it
+//return: first cluster of the directory holding the last name, 0 if a
+//directory on the way doesn't exist
+//***************************************************************************
+unsigned long resolvePath (unsigned char *path, unsigned char *fileName)
 {
-    //transmitString("filename: ");
-    
-    TX_NEWLINE;
-    TX_NEWLINE;
-    transmitString(_filePosition.fileName);
-    TX_NEWLINE;
+    struct dir_Structure *dir;
+    unsigned char name[MAX_FILENAME];
+    unsigned char length, attrib;
+    unsigned long dirCluster, cluster;
     
-    //transmitString("startCluster: ");
-    transmitHex(LONG, _filePosition.startCluster);
-    TX_NEWLINE;
+    dirCluster = _rootCluster;
     
-    //transmitString("cluster: ");
-    transmitHex(LONG, _filePosition.cluster);
-    TX_NEWLINE;
+    while (1)
+    {
+        while (*path == '/')
+            path++;
+        
+        length = 0;
+        while (path[length] != 0 && path[length] != '/')
+        {
+            if (++length == MAX_FILENAME)
+                return 0;
+        }
+        
+        // findFile changes the case of long names, it gets a copy
+        if (path[length] == 0)
+        {
+            memcpy(fileName, path, length + 1);
+            return dirCluster;
+        }
+        
+        memcpy(name, path, length);
+        name[length] = 0;
+        strupr((char *)name);
+        path += length;
+        
+        cluster = lookupDentry(dirCluster, name, &attrib);
+        if (cluster == 0)
+        {
+            dir = findFile(name, dirCluster);
+            if (dir == 0)
+                return 0;
+            
+            attrib = dir->attrib;
+            cluster = getFirstCluster(dir);
+            
+            // ".." in a directory of the root directory
+            if (cluster == 0)
+                cluster = _rootCluster;
+            
+            addDentry(dirCluster, name, cluster, attrib);
+        }
+        
+        if ((attrib & ATTR_DIRECTORY) == 0)
+            return 0;
+        
+        dirCluster = cluster;
+    }
+}
+
+//***************************************************************************
+//Function: to open a file for reading by its path, see resolvePath
+//Arguments: path of the file
+//return: 1 if the file is open, 0 if it isn't found
+//***************************************************************************
+unsigned char openPathForReading(unsigned char *path)
+{
+    unsigned char fileName[MAX_FILENAME];
+    unsigned long dirCluster;
+    
+    dirCluster = resolvePath(path, fileName);
+    if (dirCluster == 0 || fileName[0] == 0)
+        return 0;
+    
+    return openFileForReading(fileName, dirCluster);
+}
+
+//***************************************************************************
+//Function: to open a file for writing by its path, see resolvePath. The
+//directories on the way have to exist
+//Arguments: path of the file
+//return: 1 if the file is open, 0 if its directory isn't found
+//***************************************************************************
+unsigned char openPathForWriting(unsigned char *path)
+{
+    unsigned char fileName[MAX_FILENAME];
+    unsigned long dirCluster;
+    
+    dirCluster = resolvePath(path, fileName);
+    if (dirCluster == 0 || fileName[0] == 0)
+        return 0;
+    
+    openFileForWriting(fileName, dirCluster);
+    return 1;
+}
+
+unsigned long getFirstCluster(struct dir_Structure *dir)
+{
+    return (((unsigned long) dir->firstClusterHI) << 16) | dir->firstClusterLO;
+}
+
+unsigned char openFileForReading(unsigned char *fileName, unsigned long dirCluster)
+{
+    struct dir_Structure *dir;
+    
+    dir = findFile(fileName, dirCluster);
+    if (dir == 0)
+    {
+        return 0;
+    }
+    
+    _filePosition.fileSize = dir->fileSize;
+    _filePosition.startCluster = getFirstCluster(dir);
+    
+    _filePosition.cluster = _filePosition.startCluster;
+    _filePosition.byteCounter = 0;
+    _filePosition.sectorIndex = 0;
+    _filePosition.dirStartCluster = dirCluster;
+    _filePosition.pendingCluster = 0;
+    _filePosition.extentCount = 0;
+    _filePosition.extentIndex = 0;
+    _filePosition.extentBase = 0;
+    _filePosition.mappedNext = _filePosition.startCluster;
+    _filePosition.byte = 0;
+    _filePosition.bufferLength = 0;
+    
+    return 1;
+}
+
+//***************************************************************************
+//Function: to move the read position of the file opened with
+//openFileForReading. The next getNextFileBlock returns the sector holding
+//offset, which starts at _filePosition.byte in _buffer. Only FAT sectors
+//for runs not in the extent table are read
+//Arguments: byte offset in the file, up to its size
+//return: 0 if the position is set, 1 if it is past the end of the file
+//***************************************************************************
+unsigned char seekFile(unsigned long offset)
+{
+    unsigned long bytesPerCluster, clusterIndex, base;
+    unsigned char sectorIndex, i;
+    file_extent *extents = (file_extent *)_filePosition.extents;
+    
+    if (offset > _filePosition.fileSize)
+        return 1;
+    
+    // an empty file has no clusters to position on
+    if (_filePosition.fileSize == 0)
+        return 0;
+    
+    bytesPerCluster = (unsigned long)_sectorPerCluster * _bytesPerSector;
+    clusterIndex = offset / bytesPerCluster;
+    sectorIndex = (offset % bytesPerCluster) / _bytesPerSector;
+    
+    // at a cluster boundary stay at the end of the previous cluster, so
+    // getNextFileBlock moves on to the next one as after reading it
+    if (offset > 0 && sectorIndex == 0 && (offset % _bytesPerSector) == 0)
+    {
+        clusterIndex--;
+        sectorIndex = _sectorPerCluster;
+    }
+    
+    // runs dropped from the table are mapped again from the start
+    if (clusterIndex < _filePosition.extentBase)
+    {
+        _filePosition.extentCount = 0;
+        _filePosition.extentBase = 0;
+        _filePosition.mappedNext = _filePosition.startCluster;
+    }
+    
+    // find the extent holding the cluster
+    i = 0;
+    base = _filePosition.extentBase;
+    while (1)
+    {
+        if (i >= _filePosition.extentCount)
+        {
+            // mapping may drop runs before i to make room
+            _filePosition.extentIndex = i;
+            mapFileExtents();
+            i = _filePosition.extentIndex;
+            if (i >= _filePosition.extentCount)
+                return 1;
+        }
+        
+        if (clusterIndex < base + extents[i].length)
+            break;
+        
+        base += extents[i].length;
+        i++;
+    }
+    
+    _filePosition.extentIndex = i;
+    _filePosition.cluster = extents[i].cluster + (clusterIndex - base);
+    _filePosition.sectorIndex = sectorIndex;
+    _filePosition.byteCounter = offset - (offset % _bytesPerSector);
+    _filePosition.byte = offset % _bytesPerSector;
+    _filePosition.bufferLength = 0;
+    
+    return 0;
+}
+
+//***************************************************************************
+//Function: to make sure the buffered reader has a byte to hand out at
+//_filePosition.byte, reading the next sector once the current one is used
+//up. Don't mix the buffered reader with calls to getNextFileBlock
+//Arguments: none
+//return: 1 if a byte is available, 0 at the end of the file
+//***************************************************************************
+unsigned char fillFileBuffer(void)
+{
+    if (_filePosition.byte < _filePosition.bufferLength)
+    {
+        // _buffer may have been used for something else in between
+        if (_bufferBlock != _filePosition.bufferSector)
+            SD_readSingleBlock(_filePosition.bufferSector);
+        return 1;
+    }
+    
+    if (_filePosition.byteCounter >= _filePosition.fileSize)
+        return 0;
+    
+    // a sector used up starts the next one at its first byte, after
+    // seekFile the offset into the sector is kept
+    if (_filePosition.bufferLength != 0)
+        _filePosition.byte = 0;
+    
+    _filePosition.bufferLength = getNextFileBlock();
+    _filePosition.bufferSector = _bufferBlock;
+    
+    return (_filePosition.byte < _filePosition.bufferLength);
+}
+
+//***************************************************************************
+//Function: to read bytes from the file opened with openFileForReading,
+//records may cross sector boundaries
+//Arguments: #1.destination #2.number of bytes
+//return: number of bytes read, less than count at the end of the file
+//***************************************************************************
+unsigned int readFileBytes(unsigned char *dest, unsigned int count)
+{
+    unsigned int done = 0;
+    unsigned int n;
+    
+    while (done < count)
+    {
+        // whole sectors go straight to dest, without passing _buffer
+        if (count - done >= 512
+            && _filePosition.byte == _filePosition.bufferLength
+            && _filePosition.byteCounter < _filePosition.fileSize)
+        {
+            done += getNextFileBlockInto(dest + done);
+            _filePosition.byte = 0;
+            _filePosition.bufferLength = 0;
+            continue;
+        }
+        
+        if (!fillFileBuffer())
+            break;
+        
+        n = _filePosition.bufferLength - _filePosition.byte;
+        if (n > count - done)
+            n = count - done;
+        
+        memcpy(dest + done, (void *)&_buffer[_filePosition.byte], n);
+        _filePosition.byte += n;
+        done += n;
+    }
+    
+    return done;
+}
+
+//***************************************************************************
+//Function: to read one byte from the file opened with openFileForReading
+//Arguments: none
+//return: the byte, or FILE_END at the end of the file
+//***************************************************************************
+int readFileChar(void)
+{
+    if (!fillFileBuffer())
+        return FILE_END;
+    
+    return _buffer[_filePosition.byte++];
+}
+
+//***************************************************************************
+//Function: to read from the file opened with openFileForReading up to and
+//including a delimiter, e.g. a line of a config file; dest is 0 terminated
+//Arguments: #1.destination #2.its size, at least 1 #3.delimiter
+//return: number of bytes read, without the terminating 0
+//***************************************************************************
+unsigned int readFileLine(unsigned char *dest, unsigned int max, unsigned char delimiter)
+{
+    unsigned int done = 0;
+    unsigned char c;
+    
+    while (done + 1 < max && fillFileBuffer())
+    {
+        c = _buffer[_filePosition.byte++];
+        dest[done++] = c;
+        
+        if (c == delimiter)
+            break;
+    }
+    
+    dest[done] = 0;
+    return done;
+}
+
+unsigned int getNextFileBlock()
+{
+    return getNextFileBlockInto((unsigned char *)_buffer);
+}
+
+//***************************************************************************
+//Function: to read the next sector of the file opened with
+//openFileForReading into any 512 byte buffer, see getNextFileBlock
+//Arguments: destination
+//return: number of valid bytes in the sector, 0 if the cluster chain ends
+//        before the file size says
+//***************************************************************************
+unsigned int getNextFileBlockInto(unsigned char *dest)
+{
+    unsigned long sector;
+    unsigned int length;
+    
+    sector = startFileBlockRead(&length);
+    
+    if (length == 0)
+        return 0;
+    
+    // a sector still in the buffer, e.g. after seekFile, is not read again
+    if (sector == _bufferBlock)
+    {
+        if (dest != _buffer)
+            memcpy(dest, (void *)_buffer, 512);
+    }
+    else
+    {
+        SD_readNextBlockInto(dest);
+    }
+    
+    return length;
+}
+
+//***************************************************************************
+//Function: to hand the next sector of the file opened with
+//openFileForReading byte by byte to a sink as it comes off the card,
+//e.g. transmitByte, without going through a buffer
+//Arguments: sink, called once for each valid byte of the sector
+//return: number of valid bytes in the sector, 0 if the cluster chain ends
+//        before the file size says
+//***************************************************************************
+unsigned int getNextFileBlockToSink(byte_sink sink)
+{
+    unsigned long sector;
+    unsigned int length;
+    unsigned int i;
+    
+    sector = startFileBlockRead(&length);
+    
+    if (length == 0)
+        return 0;
+    
+    if (sector == _bufferBlock)
+    {
+        for (i = 0; i < length; i++)
+            sink(_buffer[i]);
+    }
+    else
+    {
+        SD_readNextBlockToSink(sink, length);
+    }
+    
+    return length;
+}
+
+//***************************************************************************
+//Function: to move the file opened with openFileForReading on to its next
+//sector, and get a multiple block read going at it unless the sector is
+//still in _buffer
+//Arguments: number of valid bytes in the sector, returned; 0 if the
+//cluster chain ends before the file size says, the read is then over
+//return: the sector
+//***************************************************************************
+unsigned long startFileBlockRead(unsigned int *length)
+{
+    unsigned long sector;
+    unsigned long sectorsInRun;
+    unsigned long sectorsInFile;
+    unsigned char nextExtent = 0;
+    file_extent *extent;
+    
+    // if cluster has no more sectors, move to next cluster
+    if (_filePosition.sectorIndex == _sectorPerCluster)
+    {
+        _filePosition.sectorIndex = 0;
+        extent = (file_extent *)&_filePosition.extents[_filePosition.extentIndex];
+        
+        if (_filePosition.cluster + 1 < extent->cluster + extent->length)
+        {
+            _filePosition.cluster++;
+        }
+        else
+        {
+            // end of the extent, the chain continues elsewhere
+            _filePosition.extentIndex++;
+            nextExtent = 1;
+        }
+    }
+    
+    if (_filePosition.extentIndex >= _filePosition.extentCount)
+    {
+        mapFileExtents();
+        
+        // mapFileExtents followed the chain as far as it goes, so the
+        // FAT has no next cluster either: end the read as at the end of
+        // the file rather than use an extent that was never filled
+        if (_filePosition.extentIndex >= _filePosition.extentCount)
+        {
+            _filePosition.byteCounter = _filePosition.fileSize;
+            *length = 0;
+            return 0;
+        }
+    }
+    
+    if (nextExtent)
+        _filePosition.cluster = _filePosition.extents[_filePosition.extentIndex].cluster;
+    
+    sector = getFirstSector(_filePosition.cluster) + _filePosition.sectorIndex;
+    
+    if (sector != _bufferBlock)
+    {
+        // open a multiple block read for the rest of the run, unless the card is
+        // already streaming this sector
+        if (_streamMode != STREAM_READ || _startBlock != sector)
+        {
+            extent = (file_extent *)&_filePosition.extents[_filePosition.extentIndex];
+            
+            sectorsInRun = (extent->cluster + extent->length - _filePosition.cluster) * _sectorPerCluster
+                           - _filePosition.sectorIndex;
+            sectorsInFile = (_filePosition.fileSize - _filePosition.byteCounter + 511) / 512;
+            
+            SD_readMultipleBlock(sector, sectorsInRun < sectorsInFile ? sectorsInRun : sectorsInFile);
+        }
+    }
+    _filePosition.byteCounter += 512;
+    _filePosition.sectorIndex++;
+    
+    if (_filePosition.byteCounter > _filePosition.fileSize)
+    {
+        *length = _filePosition.fileSize - (_filePosition.byteCounter - 512);
+    }
+    else
+    {
+        *length = 512;
+    }
+    
+    return sector;
+}
+
+// open a new file for writing
+void openFileForWriting(unsigned char *fileName, unsigned long dirCluster)
+{
+    unsigned long cluster;
+    unsigned char i;
+    
+    // use existing buffer for filename
+    _filePosition.fileName = (unsigned char *)_longEntryString;
+    memset(_filePosition.fileName, 0, MAX_FILENAME);
+    //strcpy(_filePosition.fileName, fileName);
+    
+    i = 0;
+    while (fileName[i] != 0)
+    {
+        transmitHex(CHAR, i);
+        _filePosition.fileName[i] = fileName[i];
+        i++;
+    }
+
+    memset((void *)_filePosition.shortFilename, 0, 11);
+    
+    // find the start cluster for this file
+    cluster = searchNextFreeCluster(_nextFreeCluster);
+    
+    // set the start cluster with EOF
+    
+    getSetNextCluster(cluster, SET, EOF);   //last cluster of the file, marked EOF
+#if !FAT_CACHE
+    flushFATCache();   //_buffer is the caller's from here on
+#endif
+    
+    _filePosition.startCluster = cluster;
+    _filePosition.cluster = cluster;
+    _filePosition.chainTail = cluster;
+    _filePosition.pendingCluster = 0;
+    _filePosition.allocEndCluster = 0;
+    _filePosition.byte = 0;
+    _fileBufferDirty = 0;
+    _filePosition.fileSize = 0;
+    _filePosition.sectorIndex = 0;
+    _filePosition.dirStartCluster = dirCluster;
+    _appendFileSector = 0;
+}
+
+//***************************************************************************
+//Function: to open an existing file to add data at its end with the
+//buffered writer (writeFileBytes/writeFileChar). Only the last partly filled
+//sector is read back; closeFile updates the size in the directory entry.
+//The chain is walked from the tail found by the previous call for the same
+//file, so a growing file is only walked in full once
+//Arguments: #1.file name #2.first cluster of its directory
+//return: 1 if the file is open, 0 if it is not found or its chain is short
+//***************************************************************************
+unsigned char openFileForAppending(unsigned char *fileName, unsigned long dirCluster)
+{
+    struct dir_Structure *dir;
+    unsigned long bytesPerCluster, index, target, cluster, startCluster, next, fileSize;
+    unsigned long entrySector, entryLocation;
+    
+    dir = findFile(fileName, dirCluster);
+    if (dir == 0)
+    {
+        return 0;
+    }
+    
+    // remember where the directory entry is
+    entrySector = _bufferBlock;
+    entryLocation = (unsigned char *)dir - (unsigned char *)_buffer;
+    
+    fileSize = dir->fileSize;
+    cluster = getFirstCluster(dir);
+    
+    if (cluster == 0)
+    {
+        // empty file without clusters yet
+        cluster = searchNextFreeCluster(_nextFreeCluster);
+        getSetNextCluster(cluster, SET, EOF);
+        fileSize = 0;
+    }
+    
+    startCluster = cluster;
+    bytesPerCluster = (unsigned long)_sectorPerCluster * _bytesPerSector;
+    target = fileSize / bytesPerCluster;   //index of the cluster holding the first free byte
+    index = 0;
+    
+    if (_appendStartCluster == cluster && _appendTailIndex <= target)
+    {
+        cluster = _appendTailCluster;
+        index = _appendTailIndex;
+    }
+    
+    while (index < target)
+    {
+        next = getSetNextCluster(cluster, GET, 0);
+        if (next < 2 || next > 0x0ffffff6)
+            break;
+        cluster = next;
+        index++;
+    }
+    
+#if !FAT_CACHE
+    flushFATCache();   //before _buffer gets the last sector
+#endif
+    
+    // a chain shorter than the file size, only a file that fills its last
+    // cluster may end one cluster early; nothing is set up for it
+    if (index < target && (index + 1 < target || (fileSize % bytesPerCluster) != 0))
+        return 0;
+    
+    _appendFileSector = entrySector;
+    _appendFileLocation = entryLocation;
+    
+    _appendStartCluster = startCluster;
+    _appendTailCluster = cluster;
+    _appendTailIndex = index;
+    
+    _filePosition.dirStartCluster = dirCluster;
+    _filePosition.pendingCluster = 0;
+    _filePosition.allocEndCluster = 0;
+    _filePosition.startCluster = startCluster;
+    _filePosition.cluster = cluster;
+    _filePosition.chainTail = cluster;
+    _filePosition.sectorIndex = (fileSize % bytesPerCluster) / _bytesPerSector;
+    _filePosition.byte = fileSize % _bytesPerSector;
+    _filePosition.fileSize = fileSize - _filePosition.byte;   //the partial sector is added again when written
+    _fileBufferDirty = 0;
+    
+    if (index < target)
+    {
+        // the file fills its last cluster, the next write goes to a new one
+        advanceWriteCluster();
+    }
+    else if (_filePosition.byte != 0)
+    {
+        // read-modify-write of the last partly filled sector
+        SD_readSingleBlock(getFirstSector(_filePosition.cluster) + _filePosition.sectorIndex);
+    }
+    
+    return 1;
+}
+
+//***************************************************************************
+//Function: to write _buffer as the next sector of the file opened with
+//openFileForWriting; the caller fills _buffer first. Don't call tickFSInfo
+//between filling _buffer and writing it, it doesn't know _buffer is in use
+//Arguments: number of bytes of the file in it
+//return: 0 if it is written, 1 if the card is full
+//***************************************************************************
+unsigned char writeBufferToFile(unsigned int bytesToWrite)
+{
+    return writeBlockToFile((unsigned char *)_buffer, bytesToWrite);
+}
+
+//***************************************************************************
+//Function: to write any 512 byte buffer as the next sector of the file
+//opened with openFileForWriting, see writeBufferToFile
+//Arguments: #1.source #2.number of bytes of the file in it
+//return: 0 if it is written, 1 if the card is full
+//***************************************************************************
+unsigned char writeBlockToFile(unsigned char *src, unsigned int bytesToWrite)
+{
+    if (startFileBlockWrite())
+        return 1;
+    SD_writeNextBlockFrom(src);
+    endFileBlockWrite(bytesToWrite);
+    return 0;
+}
+
+//***************************************************************************
+//Function: to write the next sector of the file opened with
+//openFileForWriting byte by byte from a source as it goes to the card,
+//without going through a buffer; a sector with less than 512 bytes ends
+//the file like writeBufferToFile does
+//Arguments: #1.source, called once for each byte #2.number of bytes
+//return: 0 if it is written, 1 if the card is full and the source isn't
+//called
+//***************************************************************************
+unsigned char writeSourceToFile(byte_source source, unsigned int bytesToWrite)
+{
+    if (startFileBlockWrite())
+        return 1;
+    SD_writeNextBlockFromSource(source, bytesToWrite);
+    endFileBlockWrite(bytesToWrite);
+    return 0;
+}
+
+//***************************************************************************
+//Function: to get a multiple block write going at the current sector of the
+//file opened with openFileForWriting. A file that ran out of free clusters
+//tries once more to get the next one
+//Arguments: none
+//return: 0 if the write is going, 1 if the card is full
+//***************************************************************************
+unsigned char startFileBlockWrite(void)
+{
+    unsigned long sector;
+    
+    if (_filePosition.sectorIndex == _sectorPerCluster && advanceWriteCluster())
+        return 1;
+    
+    // write a block to current file
+    sector = getFirstSector(_filePosition.cluster) + _filePosition.sectorIndex;
+    
+    // keep one open ended multiple block write going for as long as
+    // the reserved clusters are contiguous
+    if (_streamMode != STREAM_WRITE || _startBlock != sector)
+    {
+        // the preallocated part of the file is known, let the card pre-erase it
+        if (_filePosition.cluster <= _filePosition.allocEndCluster)
+            SD_writeMultipleBlock(sector, (_filePosition.allocEndCluster - _filePosition.cluster + 1) * _sectorPerCluster
+                                          - _filePosition.sectorIndex);
+        else
+            SD_writeMultipleBlock(sector, 0);
+    }
+    
+    return 0;
+}
+
+//***************************************************************************
+//Function: to move the file opened with openFileForWriting on past the
+//sector just written; on a full card the file is left at the end of its
+//last cluster and the next write fails
+//Arguments: number of bytes of the file in it
+//return: none
+//***************************************************************************
+void endFileBlockWrite(unsigned int bytesToWrite)
+{
+    _filePosition.fileSize += bytesToWrite;
+    _filePosition.sectorIndex++;
+    
+    if (_filePosition.sectorIndex == _sectorPerCluster)
+    {
+        advanceWriteCluster();
+    }
+}
+
+//***************************************************************************
+//Function: to move the write position to the first sector of the next
+//cluster of the file, reserving it if it isn't preallocated
+//Arguments: none
+//return: 0 if it is moved, 1 if the card is full; the position stays at
+//the end of the last cluster then
+//***************************************************************************
+unsigned char advanceWriteCluster(void)
+{
+    unsigned long nextCluster;
+    
+    nextCluster = _filePosition.cluster + 1;
+    
+    // clusters from preallocateFile are already linked in the FAT
+    if (nextCluster > _filePosition.allocEndCluster)
+    {
+        // reserve the following cluster in RAM if it is free, the FAT
+        // is only written once the run is committed
+        if (nextCluster < _totalClusters && getSetNextCluster(nextCluster, GET, 0) == 0)
+        {
+            if (_filePosition.pendingCluster == 0)
+                _filePosition.pendingCluster = nextCluster;
+        }
+        else
+        {
+            // the run can't grow, commit it and start a new one
+            commitClusterChain();
+            nextCluster = searchNextFreeCluster(_filePosition.cluster);
+            if (nextCluster == 0)
+            {
+                _filePosition.sectorIndex = _sectorPerCluster;
+                return 1;
+            }
+            _filePosition.pendingCluster = nextCluster;
+        }
+    }
+    _filePosition.cluster = nextCluster;
+    _filePosition.sectorIndex = 0;
+    
+#if CHAIN_COMMIT_CLUSTERS
+    if (_filePosition.cluster - _filePosition.pendingCluster + 1 >= CHAIN_COMMIT_CLUSTERS)
+        commitClusterChain();
+#endif
+    
+    return 0;
+}
+
+//***************************************************************************
+//Function: to write bytes to the file opened with openFileForWriting. They
+//are gathered in _buffer and only full sectors are written, the last one on
+//syncFile or closeFile; _buffer must not be used for anything else meanwhile
+//Arguments: #1.source #2.number of bytes
+//return: 0 if they are taken, 1 if the card is full; the bytes of the
+//sector that didn't fit are dropped then
+//***************************************************************************
+unsigned char writeFileBytes(unsigned char *src, unsigned int count)
+{
+    unsigned int n;
+    
+    while (count > 0)
+    {
+        // whole sectors are written straight from src
+        if (_filePosition.byte == 0 && count >= 512)
+        {
+            if (writeBlockToFile(src, 512))
+                return 1;
+            src += 512;
+            count -= 512;
+            continue;
+        }
+        
+        n = 512 - _filePosition.byte;
+        if (n > count)
+            n = count;
+        
+        prepareFileBuffer();
+        
+        memcpy((void *)&_buffer[_filePosition.byte], src, n);
+        _filePosition.byte += n;
+        src += n;
+        count -= n;
+        
+        if (_filePosition.byte == 512)
+        {
+            _filePosition.byte = 0;
+            _fileBufferDirty = 0;
+            if (writeBufferToFile(512))
+                return 1;
+        }
+    }
+    
+    return 0;
+}
+
+//***************************************************************************
+//Function: to write one byte to the file opened with openFileForWriting,
+//see writeFileBytes
+//Arguments: the byte
+//return: 0 if it is taken, 1 if the card is full
+//***************************************************************************
+unsigned char writeFileChar(unsigned char c)
+{
+    prepareFileBuffer();
+    
+    _buffer[_filePosition.byte++] = c;
+    
+    if (_filePosition.byte == 512)
+    {
+        _filePosition.byte = 0;
+        _fileBufferDirty = 0;
+        return writeBufferToFile(512);
+    }
+    
+    return 0;
+}
+
+//***************************************************************************
+//Function: to get _buffer ready for the buffered writer to add bytes. A
+//partly filled sector that is on the card already, after syncFile or
+//openFileForAppending, is read back if _buffer was used for something else
+//in between, by tickFSInfo or the FAT code
+//Arguments: none
+//return: none
+//***************************************************************************
+void prepareFileBuffer(void)
+{
+    unsigned long sector;
+    
+    if (_fileBufferDirty)
+        return;
+    
+    if (_filePosition.byte != 0)
+    {
+        sector = getFirstSector(_filePosition.cluster) + _filePosition.sectorIndex;
+        if (_bufferBlock != sector)
+            SD_readSingleBlock(sector);
+    }
+    
+    // _buffer no longer holds what the card has in the block it was
+    // read from or written to
+    _bufferBlock = NO_BLOCK;
+    _fileBufferDirty = 1;
+}
+
+//***************************************************************************
+//Function: to get the data written so far and its cluster chain onto the
+//card without closing the file. A partly filled sector is written in place
+//and stays in _buffer to be completed; the directory entry of a new file
+//is still only made by closeFile
+//Arguments: none
+//return: none
+//***************************************************************************
+void syncFile(void)
+{
+    unsigned long sector;
+    
+    sector = getFirstSector(_filePosition.cluster) + _filePosition.sectorIndex;
+    
+    if (_filePosition.byte != 0)
+    {
+        prepareFileBuffer();
+        memset((void *)&_buffer[_filePosition.byte], 0, 512 - _filePosition.byte);
+        SD_writeSingleBlock(sector);
+        _fileBufferDirty = 0;
+    }
+    else
+    {
+        SD_stopMultipleBlock();
+    }
+    
+    // without FAT_CACHE the FAT goes through _buffer, prepareFileBuffer
+    // gets the sector back when the next byte is written
+    commitClusterChain();
+    flushFATCache();
+}
+
+//***************************************************************************
+//Function: to link the clusters reserved in RAM by writeBufferToFile into
+//the cluster chain of the file in the FAT, the last one is marked EOF. A
+//cluster the writer only just moved on to holds no data yet; it stays
+//reserved, and closeFile gives it back if nothing more is written
+//Arguments: none
+//return: none
+//***************************************************************************
+void commitClusterChain (void)
+{
+    unsigned long cluster, last;
+    
+    last = _filePosition.cluster;
+    if (_filePosition.sectorIndex == 0 && _filePosition.byte == 0 && _filePosition.fileSize != 0)
+        last--;
+    
+    if (_filePosition.pendingCluster == 0 || _filePosition.pendingCluster > last)
+        return;
+    
+    // the run is contiguous, most entries share a cached FAT sector
+    for (cluster = _filePosition.pendingCluster; cluster < last; cluster++)
+        getSetNextCluster(cluster, SET, cluster + 1);
+    getSetNextCluster(last, SET, EOF);
+    
+    // only then hook the run onto the chain
+    getSetNextCluster(_filePosition.chainTail, SET, _filePosition.pendingCluster);
+    
+    _filePosition.chainTail = last;
+    _filePosition.pendingCluster = (last == _filePosition.cluster) ? 0 : _filePosition.cluster;
+    
+#if !FAT_CACHE
+    flushFATCache();   //the writer fills _buffer next
+#endif
+}
+
+//***************************************************************************
+//Function: to link a contiguous run of clusters to a file just opened with
+//openFileForWriting, so it can be written and read back as one multiple
+//block transfer. If no free run is long enough the longest one is taken and
+//the rest is allocated while writing; clusters the file doesn't grow into
+//are freed on closeFile
+//Arguments: #1.expected file size in bytes #2.returns first sector of the run
+//return: number of sectors in the run, 0 if the file was already written to
+//***************************************************************************
+unsigned long preallocateFile (unsigned long size, unsigned long *startSector)
+{
+    unsigned long clusters, cluster, group, *value;
+    unsigned long runStart = 0, runLength = 0, bestStart = 0, bestLength = 0;
+    unsigned char i;
+    
+    // nothing written yet, and openFileForWriting found a cluster
+    if (_filePosition.fileSize != 0 || _filePosition.sectorIndex != 0
+        || _filePosition.startCluster == 0)
+        return 0;
+    
+    clusters = (size + (unsigned long)_sectorPerCluster * _bytesPerSector - 1)
+               / ((unsigned long)_sectorPerCluster * _bytesPerSector);
+    if (clusters == 0)
+        clusters = 1;
+    
+    // the cluster given out by openFileForWriting may become part of the run
+    getSetNextCluster(_filePosition.startCluster, SET, 0);
+    
+    // one pass over the FAT for the longest free run, done once one is long enough
+    cluster = 0;
+    while (cluster < _totalClusters && bestLength < clusters)
+    {
+        group = (cluster / 128) >> _freeMapShift;
+        if (_freeMap[group / 8] & (1 << (group % 8)))
+        {
+            // group known to be full
+            runLength = 0;
+            cluster = ((group + 1) << _freeMapShift) * 128;
+            continue;
+        }
+        
+        loadFATSector(_unusedSectors + _reservedSectorCount + ((cluster * 4) / _bytesPerSector));
+        for (i = 0; i < 128 && cluster + i < _totalClusters; i++)
+        {
+            value = (unsigned long *) &_fatBuffer[i*4];
+            if (((*value) & 0x0fffffff) != 0)
+            {
+                runLength = 0;
+                continue;
+            }
+            
+            if (runLength == 0)
+                runStart = cluster + i;
+            runLength++;
+            
+            if (runLength > bestLength)
+            {
+                bestStart = runStart;
+                bestLength = runLength;
+                if (bestLength == clusters)
+                    break;
+            }
+        }
+        cluster += 128;
+    }
+    
+    if (bestLength == 0)
+    {
+        // no free run found, keep the cluster the file already has
+        getSetNextCluster(_filePosition.startCluster, SET, EOF);
+#if !FAT_CACHE
+        flushFATCache();
+#endif
+        return 0;
+    }
+    
+    // link the whole run, consecutive entries share a cached FAT sector
+    for (cluster = bestStart; cluster < bestStart + bestLength - 1; cluster++)
+        getSetNextCluster(cluster, SET, cluster + 1);
+    getSetNextCluster(cluster, SET, EOF);
+#if !FAT_CACHE
+    flushFATCache();
+#endif
+    
+    _filePosition.startCluster = bestStart;
+    _filePosition.cluster = bestStart;
+    _filePosition.chainTail = cluster;
+    _filePosition.allocEndCluster = cluster;
+    
+    *startSector = getFirstSector(bestStart);
+    return bestLength * _sectorPerCluster;
+}
+
+/*
+void printFileInfo()
+{
+    //transmitString("filename: ");
+    
+    TX_NEWLINE;
+    TX_NEWLINE;
+    transmitString(_filePosition.fileName);
+    TX_NEWLINE;
+    
+    //transmitString("startCluster: ");
+    transmitHex(LONG, _filePosition.startCluster);
+    TX_NEWLINE;
+    
+    //transmitString("cluster: ");
+    transmitHex(LONG, _filePosition.cluster);
+    TX_NEWLINE;
     
     //transmitString("dirStartCluster: ");
     transmitHex(LONG, _filePosition.dirStartCluster);
@@ -626,7 +2042,7 @@ void closeFile()
 {
     unsigned char fileCreatedFlag = 0;
     unsigned char sector, j;
-    unsigned long prevCluster, firstSector, cluster;
+    unsigned long firstSector, cluster;
     unsigned int firstClusterHigh, i;
     unsigned int firstClusterLow;
     struct dir_Structure *dir;
@@ -640,6 +2056,79 @@ void closeFile()
     unsigned char num_long_entries;
     unsigned char curr_fname_pos;
     unsigned char curr_long_entry;
+    unsigned long oldSize;
+    unsigned long runCluster = 0, dirtySector;
+    unsigned char runSector = 0, runLength, atEnd;
+    unsigned int runEntry = 0;
+    unsigned long freeCluster = 0;
+    unsigned char freeSector = 0, freeLength = 0, freeOpen = 1;
+    unsigned int freeEntry = 0;
+    unsigned char fromHint = 0;
+    
+    // the last sector of the buffered writer goes out once, here
+    if (_filePosition.byte != 0)
+    {
+        prepareFileBuffer();
+        memset((void *)&_buffer[_filePosition.byte], 0, 512 - _filePosition.byte);
+        i = _filePosition.byte;
+        _filePosition.byte = 0;
+        _fileBufferDirty = 0;
+        writeBufferToFile(i);
+    }
+    
+    // finish the write of a partly filled cluster and commit its cluster chain
+    SD_stopMultipleBlock();
+    
+    // a file that ends with a full cluster has already moved on to the next
+    // one, which holds nothing: drop it from the reserved run, or from the
+    // preallocated one so it is freed below
+    if (_filePosition.sectorIndex == 0 && _filePosition.fileSize != 0)
+    {
+        if (_filePosition.pendingCluster == _filePosition.cluster)
+        {
+            _filePosition.pendingCluster = 0;
+            _filePosition.cluster = _filePosition.chainTail;
+        }
+        else if (_filePosition.pendingCluster != 0 || _filePosition.cluster <= _filePosition.allocEndCluster)
+        {
+            _filePosition.cluster--;
+        }
+        _filePosition.sectorIndex = _sectorPerCluster;
+    }
+    
+    // give back the preallocated clusters the file did not grow into
+    if (_filePosition.allocEndCluster > _filePosition.cluster)
+    {
+        for (cluster = _filePosition.cluster + 1; cluster <= _filePosition.allocEndCluster; cluster++)
+            getSetNextCluster(cluster, SET, 0);
+        getSetNextCluster(_filePosition.cluster, SET, EOF);
+    }
+    
+    commitClusterChain();
+    flushFATCache();
+    
+    // an appended file keeps its directory entry, only its size changes, and
+    // the first cluster if the file was empty
+    if (_appendFileSector != 0)
+    {
+        SD_readSingleBlock(_appendFileSector);
+        dir = (struct dir_Structure *) &_buffer[_appendFileLocation];
+        oldSize = dir->fileSize;
+        cluster = getFirstCluster(dir);
+        dir->fileSize = _filePosition.fileSize;
+        dir->firstClusterHI = (unsigned int) (_filePosition.startCluster >> 16);
+        dir->firstClusterLO = (unsigned int) (_filePosition.startCluster & 0xffff);
+        SD_writeSingleBlock(_appendFileSector);
+        
+        _appendFileSector = 0;
+        _nextFreeCluster = _filePosition.cluster;
+        // count only the clusters added to the file; an empty one holds
+        // a cluster once it has been given one, as below
+        freeMemoryUpdate (REMOVE, _filePosition.fileSize ? _filePosition.fileSize : 1);
+        if (cluster != 0)
+            freeMemoryUpdate (ADD, oldSize ? oldSize : 1);
+        return;
+    }
      
     islongfilename = isLongFilename(_filePosition.fileName);
     transmitHex(CHAR, islongfilename);
@@ -652,7 +2141,6 @@ void closeFile()
     {
         memset((void *)_filePosition.shortFilename, ' ', 11);
         makeShortFilename(_filePosition.fileName, (unsigned char *)_filePosition.shortFilename);
-        checkSum = ChkSum((unsigned char *)_filePosition.shortFilename);
         
         fname_len = strlen((char *)_filePosition.fileName);
         fname_remainder = fname_len % 13;
@@ -668,141 +2156,491 @@ void closeFile()
     }
     else
     {
-        // make short filename into FAT format
-        convertToShortFilename(_filePosition.fileName, (unsigned char *)_filePosition.shortFilename);
+        // make short filename into FAT format
+        convertToShortFilename(_filePosition.fileName, (unsigned char *)_filePosition.shortFilename);
+    }
+    
+    // set next free cluster, written to FSinfo by syncFSInfo
+    _nextFreeCluster = _filePosition.cluster;
+    
+#if NAME_INDEX_SIZE
+    // the directory gets a new entry
+    if (_filePosition.dirStartCluster == _nameIndexDir)
+        invalidateNameIndex(0);
+#endif
+    invalidateDentryCache(_filePosition.dirStartCluster);
+    
+    cluster = _filePosition.dirStartCluster;
+    sector = 0;
+    i = 0;
+    
+    // the search for a free entry starts at the lowest one known in this
+    // directory, the entries in front of it are in use, and a long name only
+    // if the free run there holds all its entries. Without one it starts at
+    // the end mark, if that is still there. A long name skips the entries in
+    // front only if the ~n tails of its alias in use here are known
+    if (_dirHintStart == _filePosition.dirStartCluster
+        && (islongfilename == 0 || memcmp(_dirAlias, (void *)_filePosition.shortFilename, 11) == 0))
+    {
+        if (_dirFreeCluster != 0 && (islongfilename == 0 || _dirFreeLength >= num_long_entries + 1))
+        {
+            cluster = _dirFreeCluster;
+            sector = _dirFreeSector;
+            i = _dirFreeEntry;
+            fromHint = 1;
+        }
+        else if (_dirEndCluster != 0)
+        {
+            firstSector = getFirstSector(_dirEndCluster) + _dirEndSector;
+            if (firstSector != _bufferBlock)
+                SD_readSingleBlock(firstSector);
+            
+            if (_buffer[_dirEndEntry] == EMPTY)
+            {
+                cluster = _dirEndCluster;
+                sector = _dirEndSector;
+                i = _dirEndEntry;
+                fromHint = 1;
+            }
+        }
     }
     
-    // set next free cluster in FAT
-    getSetFreeCluster (NEXT_FREE, SET, _filePosition.cluster); //update FSinfo next free cluster entry
+    // hints of another directory don't apply here
+    if (_dirHintStart != _filePosition.dirStartCluster)
+    {
+        _dirHintStart = _filePosition.dirStartCluster;
+        _dirFreeCluster = 0;
+        _dirEndCluster = 0;
+        _dirAlias[0] = 0;
+    }
     
-    prevCluster = _filePosition.dirStartCluster;
+    if (islongfilename == 1 && fromHint == 0)
+    {
+        // the whole directory is searched, the tails of this alias are
+        // known from then on
+        memcpy(_dirAlias, (void *)_filePosition.shortFilename, 11);
+        memset(_dirAliasTails, 0, sizeof(_dirAliasTails));
+    }
+    else if (islongfilename == 0 && _dirAlias[0] != 0)
+    {
+        // a short name may look like an alias
+        markAliasTail((unsigned char *)_filePosition.shortFilename, _dirAlias, _dirAliasTails);
+    }
     
-    while(1)
+    // one pass over the directory finds a run of free entries for the new
+    // ones and, for a long name, the aliases already in use
+    runLength = 0;
+    atEnd = 0;
+    while (1)
     {
-        firstSector = getFirstSector (prevCluster);
+        firstSector = getFirstSector(cluster) + sector;
+        if (firstSector != _bufferBlock)
+        {
+            if (_streamMode != STREAM_READ || _startBlock != firstSector)
+            {
+                SD_readMultipleBlock(firstSector, _sectorPerCluster - sector);
+            }
+            SD_readNextBlock();
+        }
+        
+        dir = (struct dir_Structure *) &_buffer[i];
         
-        for(sector = 0; sector < _sectorPerCluster; sector++)
+        if (dir->name[0] == EMPTY || dir->name[0] == DELETED)
         {
-            SD_readSingleBlock (firstSector + sector);
+            // lowest free entry seen, kept for the next file if the new
+            // entries don't start here
+            if (freeCluster == 0)
+            {
+                freeCluster = cluster;
+                freeSector = sector;
+                freeEntry = i;
+            }
             
-            for( i = 0; i < _bytesPerSector; i += 32)
+            // length of the run of free entries it starts, all of them
+            // from the end mark on
+            if (freeOpen)
             {
-                dir = (struct dir_Structure *) &_buffer[i];
-                
-                if(fileCreatedFlag)   //to mark last directory entry with 0x00 (empty) mark
-                { 					  //indicating end of the directory file list
-                    dir->name[0] = EMPTY;
-                    SD_writeSingleBlock(firstSector + sector);
-                    
-                    freeMemoryUpdate (REMOVE, _filePosition.fileSize); //updating free memory count in FSinfo sector
-                    return;
+                if (dir->name[0] == EMPTY)
+                {
+                    freeLength = DIR_RUN_TO_END;
+                    freeOpen = 0;
                 }
-                
-                if (islongfilename == 0)
+                else if (freeLength < DIR_RUN_TO_END - 1)
                 {
-                    if (dir->name[0] == EMPTY)
-                    {
-                        memcpy((void *)dir->name, (void *)_filePosition.shortFilename, 11);
-                        
-                        dir->attrib = ATTR_ARCHIVE;	//settting file attribute as 'archive'
-                        dir->NTreserved = 0;			//always set to 0
-                        dir->timeTenth = 0;			//always set to 0
-                        dir->createTime = 0x9684;		//fixed time of creation
-                        dir->createDate = 0x3a37;		//fixed date of creation
-                        dir->lastAccessDate = 0x3a37;	//fixed date of last access
-                        dir->writeTime = 0x9684;		//fixed time of last write
-                        dir->writeDate = 0x3a37;		//fixed date of last write
-                        
-                        firstClusterHigh = (unsigned int) ((_filePosition.startCluster & 0xffff0000) >> 16 );
-                        firstClusterLow = (unsigned int) ( _filePosition.startCluster & 0x0000ffff);
-                        
-                        dir->firstClusterHI = firstClusterHigh;
-                        dir->firstClusterLO = firstClusterLow;
-                        dir->fileSize = _filePosition.fileSize;
-                        
-                        SD_writeSingleBlock (firstSector + sector);
-                        fileCreatedFlag = 1;
-                        
-                        transmitString_F((char *)PSTR(" File Created!"));
-                    }
+                    freeLength++;
                 }
-                else
+            }
+            
+            if (runLength < num_long_entries + 1)
+            {
+                if (runLength++ == 0)
                 {
-                    if (dir->name[0] == EMPTY)
-                    {
-                        // create long directory entry
-                        longent = (struct dir_Longentry_Structure *) &_buffer[i];
-                        memset(longent, 0xff, 32);
-                        
-                        // fill in the long entry fields
-                        if (curr_long_entry == num_long_entries)
-                        {
-                            longent->LDIR_Ord = 0x40 | curr_long_entry;
-                        }
-                        else
-                        {
-                            longent->LDIR_Ord = curr_long_entry;
-                        }
-                        
-                        curr_long_entry--;
-                        curr_fname_pos = curr_long_entry * 13;
-                        
-                        j = 0;
-                        while (curr_fname_pos <= fname_len && j < 5)
-                        {
-                            longent->LDIR_Name1[j++] = _filePosition.fileName[curr_fname_pos++];
-                        }
-                        
-                        j = 0;
-                        while (curr_fname_pos <= fname_len && j < 6)
-                        {
-                            longent->LDIR_Name2[j++] = _filePosition.fileName[curr_fname_pos++];
-                        }
-                        
-                        j = 0;
-                        while (curr_fname_pos <= fname_len && j < 2)
-                        {
-                            longent->LDIR_Name3[j++] = _filePosition.fileName[curr_fname_pos++];
-                        }
-                        
-                        longent->LDIR_Attr = ATTR_LONG_NAME;
-                        longent->LDIR_Type = 0;
-                        longent->LDIR_Chksum = checkSum;
-                        longent->LDIR_FstClusLO = 0;
-                        
-                        SD_writeSingleBlock (firstSector + sector);
-                        
-                        // if there are no long entries remaining, set a flag so the next entry is the FAT short entry
-                        if (curr_long_entry == 0)
-                        {
-                            islongfilename = 0;
-                        }
-                    }
+                    runCluster = cluster;
+                    runSector = sector;
+                    runEntry = i;
+                }
+                
+                // the run takes the end mark, everything from there on is free
+                if (dir->name[0] == EMPTY)
+                {
+                    atEnd = 1;
                 }
             }
+            
+            if (dir->name[0] == EMPTY)
+            {
+                // the end mark, it only moves if the run takes it
+                _dirEndCluster = cluster;
+                _dirEndSector = sector;
+                _dirEndEntry = i;
+                break;
+            }
+            if (runLength == num_long_entries + 1 && (islongfilename == 0 || fromHint))
+            {
+                break;
+            }
+        }
+        else
+        {
+            if (runLength < num_long_entries + 1)
+            {
+                runLength = 0;
+            }
+            if (freeCluster != 0)
+            {
+                freeOpen = 0;
+            }
+            if (islongfilename == 1 && dir->attrib != ATTR_LONG_NAME)
+            {
+                markAliasTail(dir->name, (unsigned char *)_filePosition.shortFilename, _dirAliasTails);
+            }
+        }
+        
+        if (nextDirectoryPosition(&cluster, &sector, &i) == 0)
+        {
+            // the directory has no end mark, the run goes on in a new cluster
+            _dirEndCluster = 0;
+            
+            // a full card has none left: the file gets no entry and its
+            // clusters are given back
+            if (searchNextFreeCluster(cluster) == 0)
+            {
+                freeClusterChain(_filePosition.startCluster);
+                transmitString_F((char *)PSTR(" No free cluster!"));
+                return;
+            }
+            
+            if (runLength == 0)
+            {
+                runCluster = extendDirectory(cluster);
+                runSector = 0;
+                runEntry = 0;
+            }
+            if (runLength < num_long_entries + 1)
+            {
+                atEnd = 1;
+            }
+            break;
+        }
+    }
+    
+    if (islongfilename == 1)
+    {
+        // first free ~n of the alias
+        for (j = 1; j < 100 && (_dirAliasTails[j / 8] & (1 << (j % 8))); j++);
+        if (j == 100)
+        {
+            // ~1 to ~99 are all taken, the file gets no entry and its
+            // clusters are given back
+            freeClusterChain(_filePosition.startCluster);
+            transmitString_F((char *)PSTR(" No free alias!"));
+            return;
+        }
+        
+        _dirAliasTails[j / 8] |= 1 << (j % 8);
+        if (j < 10)
+        {
+            _filePosition.shortFilename[7] = '0' + j;
+        }
+        else
+        {
+            _filePosition.shortFilename[5] = '~';
+            _filePosition.shortFilename[6] = '0' + j / 10;
+            _filePosition.shortFilename[7] = '0' + j % 10;
+        }
+        checkSum = ChkSum((unsigned char *)_filePosition.shortFilename);
+    }
+    
+    // the entries are filled in in _buffer, each sector is written once
+    cluster = runCluster;
+    sector = runSector;
+    i = runEntry;
+    dirtySector = 0;
+    
+    while (1)
+    {
+        firstSector = getFirstSector(cluster) + sector;
+        if (firstSector != dirtySector)
+        {
+            if (dirtySector != 0)
+            {
+                SD_writeSingleBlock(dirtySector);
+                dirtySector = 0;
+            }
+            if (firstSector != _bufferBlock)
+            {
+                SD_readSingleBlock(firstSector);
+            }
+        }
+        
+        dir = (struct dir_Structure *) &_buffer[i];
+        
+        if(fileCreatedFlag)   //to mark last directory entry with 0x00 (empty) mark
+        { 					  //indicating end of the directory file list
+            if (dir->name[0] != EMPTY)
+            {
+                dir->name[0] = EMPTY;
+                dirtySector = firstSector;
+            }
+            
+            // the end mark moved here, the next file created here starts at it
+            _dirEndCluster = cluster;
+            _dirEndSector = sector;
+            _dirEndEntry = i;
+            _dirFreeCluster = cluster;
+            _dirFreeSector = sector;
+            _dirFreeEntry = i;
+            _dirFreeLength = DIR_RUN_TO_END;
+            break;
         }
         
-        cluster = getSetNextCluster (prevCluster, GET, 0);
+        dirtySector = firstSector;
         
-        if(cluster > 0x0ffffff6)
+        if (islongfilename == 0)
+        {
+            memcpy((void *)dir->name, (void *)_filePosition.shortFilename, 11);
+            
+            dir->attrib = ATTR_ARCHIVE;	//settting file attribute as 'archive'
+            dir->NTreserved = 0;			//always set to 0
+            dir->timeTenth = 0;			//always set to 0
+            dir->createTime = 0x9684;		//fixed time of creation
+            dir->createDate = 0x3a37;		//fixed date of creation
+            dir->lastAccessDate = 0x3a37;	//fixed date of last access
+            dir->writeTime = 0x9684;		//fixed time of last write
+            dir->writeDate = 0x3a37;		//fixed date of last write
+            
+            firstClusterHigh = (unsigned int) ((_filePosition.startCluster & 0xffff0000) >> 16 );
+            firstClusterLow = (unsigned int) ( _filePosition.startCluster & 0x0000ffff);
+            
+            dir->firstClusterHI = firstClusterHigh;
+            dir->firstClusterLO = firstClusterLow;
+            dir->fileSize = _filePosition.fileSize;
+            
+            fileCreatedFlag = 1;
+            
+            transmitString_F((char *)PSTR(" File Created!"));
+            
+            // entries after a run taken from inside the directory are in use
+            // up to the next free one, which is looked for from here
+            if (!atEnd)
+            {
+                _dirFreeCluster = cluster;
+                _dirFreeSector = sector;
+                _dirFreeEntry = i + 32;
+                _dirFreeLength = 0;
+                if (_dirFreeEntry == _bytesPerSector)
+                {
+                    _dirFreeEntry = 0;
+                    if (++_dirFreeSector == _sectorPerCluster)
+                        _dirFreeCluster = 0;
+                }
+                break;
+            }
+        }
+        else
         {
-            if(cluster == EOF)   //this situation will come when total files in root is multiple of (32*_sectorPerCluster)
-            {  
-                cluster = searchNextFreeCluster(prevCluster); //find next cluster for root directory entries
-                getSetNextCluster(prevCluster, SET, cluster); //link the new cluster of root to the previous cluster
-                getSetNextCluster(cluster, SET, EOF);  //set the new cluster as end of the root directory
-            } 
+            // create long directory entry
+            longent = (struct dir_Longentry_Structure *) &_buffer[i];
+            memset(longent, 0xff, 32);
             
+            // fill in the long entry fields
+            if (curr_long_entry == num_long_entries)
+            {
+                longent->LDIR_Ord = 0x40 | curr_long_entry;
+            }
             else
-            {	
-                transmitString_F((char *)PSTR("End of Cluster Chain"));
-                return;
+            {
+                longent->LDIR_Ord = curr_long_entry;
+            }
+            
+            curr_long_entry--;
+            curr_fname_pos = curr_long_entry * 13;
+            
+            j = 0;
+            while (curr_fname_pos <= fname_len && j < 5)
+            {
+                longent->LDIR_Name1[j++] = _filePosition.fileName[curr_fname_pos++];
+            }
+            
+            j = 0;
+            while (curr_fname_pos <= fname_len && j < 6)
+            {
+                longent->LDIR_Name2[j++] = _filePosition.fileName[curr_fname_pos++];
+            }
+            
+            j = 0;
+            while (curr_fname_pos <= fname_len && j < 2)
+            {
+                longent->LDIR_Name3[j++] = _filePosition.fileName[curr_fname_pos++];
+            }
+            
+            longent->LDIR_Attr = ATTR_LONG_NAME;
+            longent->LDIR_Type = 0;
+            longent->LDIR_Chksum = checkSum;
+            longent->LDIR_FstClusLO = 0;
+            
+            // if there are no long entries remaining, set a flag so the next entry is the FAT short entry
+            if (curr_long_entry == 0)
+            {
+                islongfilename = 0;
             }
         }
-        if(cluster == 0) {transmitString_F((char *)PSTR("Error in getting cluster")); return;}
         
-        prevCluster = cluster;
+        if (nextDirectoryPosition(&cluster, &sector, &i) == 0)
+        {
+            if (fileCreatedFlag)
+            {
+                // the entries fill the directory, it has no end mark
+                _dirEndCluster = 0;
+                _dirFreeCluster = 0;
+                break;
+            }
+            SD_writeSingleBlock(dirtySector);
+            dirtySector = 0;
+            cluster = extendDirectory(cluster);
+        }
+    }
+    
+    if (dirtySector != 0)
+    {
+        SD_writeSingleBlock(dirtySector);
+    }
+    
+    // a free entry in front of the new ones stays the one to reuse
+    if (freeCluster != 0 && (freeCluster != runCluster || freeSector != runSector || freeEntry != runEntry))
+    {
+        _dirFreeCluster = freeCluster;
+        _dirFreeSector = freeSector;
+        _dirFreeEntry = freeEntry;
+        _dirFreeLength = freeLength;
+    }
+    
+    // an empty file still has the cluster openFileForWriting gave it
+    freeMemoryUpdate (REMOVE, _filePosition.fileSize ? _filePosition.fileSize : 1); //updating free memory count kept for FSinfo
+}
+
+//***************************************************************************
+//Function: to move a directory position to the next entry
+//Arguments: cluster, sector in the cluster and byte offset in the sector
+//of the entry
+//return: 1 if the position is moved, 0 at the end of the last cluster of
+//the directory; the position is then the start of that cluster
+//***************************************************************************
+unsigned char nextDirectoryPosition (unsigned long *cluster, unsigned char *sector, unsigned int *entry)
+{
+    unsigned long next;
+    
+    *entry += 32;
+    if (*entry < _bytesPerSector)
+        return 1;
+    
+    *entry = 0;
+    if (++*sector < _sectorPerCluster)
+        return 1;
+    
+    *sector = 0;
+    next = getSetNextCluster(*cluster, GET, 0);
+    if (next == 0 || next > 0x0ffffff6)
+        return 0;
+    
+    *cluster = next;
+    return 1;
+}
+
+//***************************************************************************
+//Function: to add a cluster to a directory. It is written with zeros, so
+//every entry in it reads as an end mark
+//Arguments: last cluster of the directory
+//return: the new cluster
+//***************************************************************************
+unsigned long extendDirectory (unsigned long lastCluster)
+{
+    unsigned long cluster;
+    unsigned char sector;
+    
+    cluster = searchNextFreeCluster(lastCluster);
+    getSetNextCluster(lastCluster, SET, cluster);   //link the new cluster to the previous one
+    getSetNextCluster(cluster, SET, EOF);           //set the new cluster as end of the directory
+    flushFATCache();
+    freeMemoryUpdate(REMOVE, 1);                    //one cluster
+    
+    memset((void *)_buffer, 0, 512);
+    SD_writeMultipleBlock(getFirstSector(cluster), _sectorPerCluster);
+    for (sector = 0; sector < _sectorPerCluster; sector++)
+    {
+        SD_writeNextBlock();
+    }
+    SD_stopMultipleBlock();
+    
+    return cluster;
+}
+
+//***************************************************************************
+//Function: to give back the clusters of a file that gets no directory entry
+//Arguments: first cluster of the file
+//return: none
+//***************************************************************************
+void freeClusterChain (unsigned long cluster)
+{
+    unsigned long nextCluster;
+    
+    while (cluster >= 2 && cluster < 0x0ffffff8)
+    {
+        nextCluster = getSetNextCluster(cluster, GET, 0);
+        getSetNextCluster(cluster, SET, 0);
+        cluster = nextCluster;
+    }
+    flushFATCache();
+}
+
+//***************************************************************************
+//Function: to note the ~n tail of a short name that is an alias made by
+//makeShortFilename from the same long name start
+//Arguments: #1.short name in a directory entry #2.the new alias
+//#3.bit n set for each ~n in use, n up to 99
+//return: none
+//***************************************************************************
+void markAliasTail (unsigned char *name, unsigned char *alias, unsigned char *usedTails)
+{
+    unsigned char n;
+    
+    if (memcmp(&name[8], &alias[8], 3) != 0)
+        return;
+    
+    if (name[6] == '~' && name[7] >= '0' && name[7] <= '9' && memcmp(name, alias, 6) == 0)
+    {
+        n = name[7] - '0';
     }
+    else if (name[5] == '~' && name[6] >= '0' && name[6] <= '9' && name[7] >= '0' && name[7] <= '9' && memcmp(name, alias, 5) == 0)
+    {
+        n = (name[6] - '0') * 10 + name[7] - '0';
+    }
+    else
+    {
+        return;
+    }
+    
+    usedTails[n / 8] |= 1 << (n % 8);
 }
 
 //***************************************************************************
@@ -813,23 +2651,55 @@ void closeFile()
 //****************************************************************
 unsigned long searchNextFreeCluster (unsigned long startCluster)
 {
-  unsigned long cluster, *value, sector;
-  unsigned char i;
-    
+  unsigned long cluster, endCluster, *value, sector, fullFrom, group;
+  unsigned char i, pass;
+
 	startCluster -=  (startCluster % 128);   //to start with the first file in a FAT sector
-    for(cluster =startCluster; cluster <_totalClusters; cluster+=128) 
+    cluster = startCluster;
+    endCluster = _totalClusters;
+
+    //search up to the end of the FAT, then wrap around to the start
+    for(pass = 0; pass < 2; pass++)
     {
-      sector = _unusedSectors + _reservedSectorCount + ((cluster * 4) / _bytesPerSector);
-      SD_readSingleBlock(sector);
-      for(i=0; i<128; i++)
+      fullFrom = cluster / 128;   //FAT sectors from here on had no free cluster
+      while(cluster < endCluster)
       {
-       	 value = (unsigned long *) &_buffer[i*4];
-         if(((*value) & 0x0fffffff) == 0)
-            return(cluster+i);
-      }  
-    } 
+        group = (cluster / 128) >> _freeMapShift;
+        if(_freeMap[group / 8] & (1 << (group % 8)))
+        {
+          //the summary says this group is full, skip it
+          cluster = ((group + 1) << _freeMapShift) * 128;
+          continue;
+        }
+
+        sector = _unusedSectors + _reservedSectorCount + ((cluster * 4) / _bytesPerSector);
+        loadFATSector(sector);
+        for(i=0; i<128; i++)
+        {
+       	   value = (unsigned long *) &_fatBuffer[i*4];
+           if(((*value) & 0x0fffffff) == 0 && cluster+i < _totalClusters + 2)
+           {
+              // skip the clusters reserved for the file being written
+              if(_filePosition.pendingCluster == 0 || cluster+i < _filePosition.pendingCluster
+                 || cluster+i > _filePosition.cluster)
+                  return(cluster+i);
+              fullFrom = (cluster / 128) + 1;
+           }
+        }
+
+        //remember the group as full once all of its sectors were searched
+        if(((cluster / 128) + 1) % (1 << _freeMapShift) == 0
+           && (group << _freeMapShift) >= fullFrom)
+        {
+          _freeMap[group / 8] |= (1 << (group % 8));
+        }
+        cluster += 128;
+      }
+      cluster = 0;
+      endCluster = startCluster;
+    }
 
-    transmitString((unsigned char *)"no free sectors\r\n");
+    transmitString_F((char *)PSTR("no free sectors\r\n"));
  return 0;
 }
 
@@ -842,32 +2712,92 @@ unsigned long searchNextFreeCluster (unsigned long startCluster)
 //********************************************************************
 void freeMemoryUpdate (unsigned char flag, unsigned long size)
 {
-  unsigned long freeClusters;
+  unsigned long bytesPerCluster;
   //convert file size into number of clusters occupied
-  if ((size % 512) == 0)
-      size = size / 512;
-  else
-      size = (size / 512) +1;
-    
-  if ((size % 8) == 0)
-      size = size / 8;
-  else
-      size = (size / 8) +1;
+  bytesPerCluster = (unsigned long)_sectorPerCluster * _bytesPerSector;
+  size = (size + bytesPerCluster - 1) / bytesPerCluster;
 
   if(_freeClusterCountUpdated)
   {
-	freeClusters = getSetFreeCluster (TOTAL_FREE, GET, 0);
 	if(flag == ADD)
-  	   freeClusters = freeClusters + size;
+  	   _freeClusterCount = _freeClusterCount + size;
 	else  //when flag = REMOVE
-	   freeClusters = freeClusters - size;
-	getSetFreeCluster (TOTAL_FREE, SET, freeClusters);
+	   _freeClusterCount = _freeClusterCount - size;
+  }
+
+  //the next free cluster may have moved as well
+  _fsInfoDirty = 1;
+  _fsInfoTicks = 0;
+}
+
+//***************************************************************************
+//Function: to write the free cluster count and next free cluster kept in
+//RAM to the FSinfo sector, if they have changed. Uses _buffer
+//Arguments: none
+//return: none
+//***************************************************************************
+void syncFSInfo (void)
+{
+  struct FSInfo_Structure *FS = (struct FSInfo_Structure *) &_buffer;
+
+  if(_fsInfoDirty == 0)
+     return;
+
+  if(_bufferBlock != _unusedSectors + 1)
+     SD_readSingleBlock(_unusedSectors + 1);
+
+  if((FS->leadSignature == 0x41615252) && (FS->structureSignature == 0x61417272) && (FS->trailSignature == 0xaa550000))
+  {
+     if(_freeClusterCountUpdated)
+        FS->freeClusterCount = _freeClusterCount;
+     FS->nextFreeCluster = _nextFreeCluster;
+     SD_writeSingleBlock(_unusedSectors + 1);	//update FSinfo
   }
+
+  _fsInfoDirty = 0;
+}
+
+//***************************************************************************
+//Function: to count a tick of a periodic timer; FSinfo is written back
+//once it has been left changed for FSINFO_SYNC_TICKS ticks. Call it from
+//the main loop, like SD_poll, not from an interrupt. It waits while the
+//buffered writer has bytes in _buffer that aren't on the card; a caller of
+//writeBufferToFile that fills _buffer itself must not call it between
+//filling _buffer and writing it
+//Arguments: none
+//return: none
+//***************************************************************************
+void tickFSInfo (void)
+{
+  if(_fsInfoDirty == 0)
+     return;
+
+  if(_fsInfoTicks < FSINFO_SYNC_TICKS)
+     _fsInfoTicks++;
+  else if(_fileBufferDirty == 0)
+     syncFSInfo();
+}
+
+//***************************************************************************
+//Function: to get everything held in RAM onto the card before it is
+//removed or the power goes: the open multiple block transfer, queued
+//writes, the FAT sector cache and FSinfo
+//Arguments: none
+//return: none
+//***************************************************************************
+void unmountCard (void)
+{
+  SD_stopMultipleBlock();
+  SD_flushRequests();
+  flushFATCache();
+  syncFSInfo();
+  SD_flushRequests();
 }
 
 void makeShortFilename(unsigned char *longFilename, unsigned char *shortFilename)
 {
-    // make a short file name from the given long file name
+    // make a short file name from the given long file name, closeFile
+    // changes the ~1 to the first tail not in use in the directory
     int i;
     unsigned char thechar;
     for (i = 0; i < 6; i++)
@@ -120,6 +120,35 @@ struct dir_Longentry_Structure{
     unsigned int LDIR_Name3[2];
 };
 
+//cluster runs of the open file kept in RAM while reading
+#ifndef MAX_EXTENTS
+#define MAX_EXTENTS  2
+#endif
+
+//run of contiguous clusters of an open file
+typedef struct _file_extent {
+    unsigned long cluster;          //first cluster of the run
+    unsigned long length;           //number of clusters in the run
+} file_extent;
+
+//location of a name in the directory indexed for findFile
+typedef struct _name_index_entry {
+    unsigned int hash;              //hash of the upper case name, 0 for a free slot
+    unsigned long cluster;          //directory cursor in front of the entry
+    unsigned char sectorIndex;
+    unsigned char entry;            //byte offset in the sector / 32
+} name_index_entry;
+
+//directory found by resolvePath, by its parent and name
+#define DENTRY_NAME_LENGTH      12
+typedef struct _dentry_cache_entry {
+    unsigned long parent;           //first cluster of the directory it is in, 0 for a free entry
+    unsigned char name[DENTRY_NAME_LENGTH];   //its name in upper case, 0 padded
+    unsigned char attrib;
+    unsigned char age;              //lookups since it was last used
+    unsigned long cluster;          //its first cluster
+} dentry_cache_entry;
+
 // structure for file read information
 typedef struct _file_stat{
     unsigned long currentCluster;
@@ -139,8 +168,18 @@ typedef struct _file_position {
     unsigned long sector;
     unsigned long fileSize;
     unsigned long byteCounter;
-    unsigned int byte;
+    unsigned int byte;              //next byte of _buffer for the buffered reader and writer
     unsigned char shortFilename[11];
+    unsigned long chainTail;        //last cluster of the file linked in the FAT
+    unsigned long pendingCluster;   //first cluster of the run reserved in RAM up to cluster, 0 if none
+    unsigned long allocEndCluster;  //last cluster linked in advance by preallocateFile, 0 if none
+    unsigned char extentCount;      //extents mapped in extents[]
+    unsigned char extentIndex;      //extent holding cluster
+    unsigned long extentBase;       //index in the file of the first cluster of extents[0]
+    unsigned long mappedNext;       //cluster following the last mapped one, EOF when all are mapped
+    file_extent extents[MAX_EXTENTS];
+    unsigned int bufferLength;      //bytes of the file in _buffer, 0 if not read yet
+    unsigned long bufferSector;     //sector those bytes came from
 } file_position;
 
 //Attribute definitions for file/directory
@@ -170,19 +209,142 @@ typedef struct _file_position {
 #define GET_FILE     1
 #define DELETE		 2
 #define EOF		0x0fffffff
+#define FILE_END    (-1)    //readFileChar at the end of the file
 
 #define MAX_FILENAME 32
 
+//while writing, clusters are reserved in RAM and linked in the FAT when the
+//file is closed; set this to also commit the chain every n clusters
+#ifndef CHAIN_COMMIT_CLUSTERS
+#define CHAIN_COMMIT_CLUSTERS   0
+#endif
+
+//slots of the findFile name index, a power of 2; 0 leaves the index out.
+//each slot costs 8 bytes of RAM, short names take one, long names two
+#ifndef NAME_INDEX_SIZE
+#define NAME_INDEX_SIZE         0
+#endif
+
+//long names are hashed as far as getNextDirectoryEntry keeps them
+#define NAME_HASH_LENGTH        (MAX_FILENAME - 1)
+
+//1 keeps the FAT sector in a 512 byte cache of its own, so FAT lookups
+//don't destroy file data. The default 0 fits the ATmega168A: FAT sectors
+//that are scanned or changed share _buffer with file and directory data,
+//and single entries are read through a small window
+#ifndef FAT_CACHE
+#define FAT_CACHE               0
+#endif
+
+//bytes of the FAT window without FAT_CACHE, a power of 2; 4 per entry
+#ifndef FAT_WINDOW_BYTES
+#define FAT_WINDOW_BYTES        32
+#endif
+
+//directories kept by resolvePath, 22 bytes of RAM each; 0 leaves the
+//dentry cache out, which the ATmega168A needs. Only names up to
+//DENTRY_NAME_LENGTH characters are kept, a hit compares the whole name
+#ifndef DENTRY_CACHE_SIZE
+#define DENTRY_CACHE_SIZE       0
+#endif
+
+//tickFSInfo calls after the last change before FSinfo is written back
+#ifndef FSINFO_SYNC_TICKS
+#define FSINFO_SYNC_TICKS       100
+#endif
+
+//bytes of the free space summary, each bit covers a group of FAT sectors
+#ifndef FREE_MAP_BYTES
+#define FREE_MAP_BYTES          16
+#endif
+
 //************* external variables *************
 volatile unsigned long _firstDataSector,     _rootCluster,        _totalClusters;
 volatile unsigned int  _bytesPerSector,      _sectorPerCluster,   _reservedSectorCount;
 volatile unsigned long _unusedSectors, _appendFileSector, _appendFileLocation, _fileSize, _appendStartCluster;
+volatile unsigned long _appendTailCluster, _appendTailIndex;   //cluster reached by the last openFileForAppending, and its index in the file
+
+//free entries of the directory the last file was created in, so closeFile
+//doesn't walk it from the start. The free entry is the lowest one known,
+//deleted or the end mark, and is reused first; the end mark hint only moves
+//with the end mark. Both are checked against the entry before they are used.
+//A long name only starts at the free entry if the run of free entries there
+//is long enough for it
+#define DIR_RUN_TO_END     0xff
+volatile unsigned long _dirHintStart;       //first cluster of the directory, 0 if none
+volatile unsigned long _dirFreeCluster;     //cluster, sector and byte offset of the free entry, cluster 0 if none known
+volatile unsigned char _dirFreeSector;
+volatile unsigned int  _dirFreeEntry;
+volatile unsigned char _dirFreeLength;      //free entries from there on, DIR_RUN_TO_END up to the end mark
+volatile unsigned long _dirEndCluster;      //cluster, sector and byte offset of the end mark, cluster 0 if none known
+volatile unsigned char _dirEndSector;
+volatile unsigned int  _dirEndEntry;
+
+//~n tails in use in that directory for the alias of the last long name
+//searched for in all of it, kept up to date by the creates after it
+unsigned char _dirAlias[11];                //the alias with ~1, _dirAlias[0] 0 if none
+unsigned char _dirAliasTails[13];           //bit n set for each ~n in use
 
 //global flag to keep track of free cluster count updating in FSinfo sector
 unsigned char _freeClusterCountUpdated;
+
+//FSinfo counts kept in RAM from getBootSectorData on, _nextFreeCluster is
+//the other one; syncFSInfo writes them back
+volatile unsigned long _freeClusterCount;
+volatile unsigned char _fsInfoDirty;        //1 if FSinfo on the card is behind
+volatile unsigned int  _fsInfoTicks;        //tickFSInfo calls since the last change
+volatile unsigned char _fileBufferDirty;    //1 while the buffered writer has bytes in _buffer that aren't on the card
 volatile unsigned long _fileStartCluster;
 
 volatile unsigned char _longEntryString[MAX_FILENAME];
+
+//long name matching in getNextDirectoryEntry, set up by findFile
+unsigned char *_lfnTarget;                  //upper case name to match, 0 to only collect names
+volatile unsigned char _lfnTargetLength;    //characters of it to compare
+volatile unsigned char _lfnChecksum;        //ChkSum of the short name the long name belongs to
+volatile unsigned char _lfnMatch;           //1 while the long name read so far matches
+
+#if FAT_CACHE
+//FAT sector cache, kept apart from _buffer so FAT lookups don't destroy
+//file data; costs 512 bytes of RAM
+volatile unsigned char _fatBuffer[512];
+volatile unsigned long _fatBufferSector;    //sector held in _fatBuffer, 0 if none
+#else
+//the FAT sector is the one in _buffer. getSetNextCluster(SET) leaves it
+//changed there; openFileForWriting, openFileForAppending, preallocateFile,
+//commitClusterChain, closeFile and extendDirectory call flushFATCache before
+//they return, other code that sets entries has to do so before it uses
+//_buffer
+#define _fatBuffer              _buffer
+#define _fatBufferSector        _bufferBlock
+
+//entries around the last one looked up outside _buffer
+volatile unsigned char _fatWindow[FAT_WINDOW_BYTES];
+volatile unsigned long _fatWindowSector;    //sector the window is in, 0 if none
+volatile unsigned int  _fatWindowOffset;    //byte offset of the window in it
+#endif
+volatile unsigned char _fatBufferDirty;     //1 if _fatBuffer has to be written back
+
+//free space summary, a bit is set once its group of FAT sectors is known to
+//have no free cluster; groups are 1 << _freeMapShift FAT sectors
+volatile unsigned char _freeMap[FREE_MAP_BYTES];
+volatile unsigned char _freeMapShift;
+volatile unsigned long _nextFreeCluster;    //allocation hint, from FSinfo at mount
+
+#if NAME_INDEX_SIZE
+//names of one directory, filled in as findFile scans it
+volatile name_index_entry _nameIndex[NAME_INDEX_SIZE];
+volatile unsigned long _nameIndexDir;       //first cluster of the indexed directory, 0 if none
+volatile unsigned int _nameIndexUsed;       //slots in use
+volatile unsigned int _nameIndexEntries;    //directory entries indexed, in scan order
+volatile unsigned char _nameIndexComplete;  //1 once every entry is indexed
+volatile unsigned char _nameIndexFull;      //1 if entries didn't fit
+#endif
+
+#if DENTRY_CACHE_SIZE
+volatile dentry_cache_entry _dentryCache[DENTRY_CACHE_SIZE];
+#endif
+
 //volatile unsigned long _fileNameLong[MAX_FILENAME];
 volatile file_position _filePosition;
 
@@ -192,16 +354,32 @@ unsigned char getBootSectorData (void);
 unsigned long getFirstSector(unsigned long clusterNumber);
 unsigned long getSetFreeCluster(unsigned char totOrNext, unsigned char get_set, unsigned long FSEntry);
 struct dir_Structure* findFile (unsigned char *fileName, unsigned long firstCluster);
+struct dir_Structure* findFileEntry (unsigned char *fileName, unsigned long firstCluster);
+unsigned int nameHash (unsigned char *name, unsigned char length);
+void addToNameIndex (unsigned int hash, unsigned long cluster, unsigned char sectorIndex, unsigned char entry);
+void invalidateNameIndex (unsigned long dirCluster);
+unsigned long lookupDentry (unsigned long parent, unsigned char *name, unsigned char *attrib);
+void addDentry (unsigned long parent, unsigned char *name, unsigned long cluster, unsigned char attrib);
+void invalidateDentryCache (unsigned long dirCluster);
+unsigned long resolvePath (unsigned char *path, unsigned char *fileName);
 unsigned long getSetNextCluster (unsigned long clusterNumber,unsigned char get_set,unsigned long clusterEntry);
+void mapFileExtents (void);
+unsigned char loadFATSector (unsigned long sector);
+void flushFATCache (void);
+void commitClusterChain (void);
+unsigned long preallocateFile (unsigned long size, unsigned long *startSector);
 unsigned char readFile (unsigned char flag, unsigned char *fileName);
 
 void convertToShortFilename(unsigned char *input, unsigned char *output);
 void writeFile (unsigned char *fileName);
-void appendFile (void);
+unsigned char openFileForAppending(unsigned char *fileName, unsigned long dirCluster);
 unsigned long searchNextFreeCluster (unsigned long startCluster);
 void displayMemory (unsigned char flag, unsigned long memory);
 void deleteFile();
 void freeMemoryUpdate (unsigned char flag, unsigned long size);
+void syncFSInfo (void);
+void tickFSInfo (void);
+void unmountCard (void);
 unsigned char ChkSum (unsigned char *pFcbName);
 
 void startFileRead(struct dir_Structure *dirEntry, file_stat *thisFileStat);
@@ -211,10 +389,33 @@ unsigned long getNextBlockAddress(file_stat *thisFileStat);
 unsigned long getFirstCluster(struct dir_Structure *dir);
 void openFileForWriting(unsigned char *fileName, unsigned long dirCluster);
 unsigned char openFileForReading(unsigned char *fileName, unsigned long dirCluster);
+unsigned char openPathForReading(unsigned char *path);
+unsigned char openPathForWriting(unsigned char *path);
 unsigned int getNextFileBlock();
-void writeBufferToFile(unsigned int bytesToWrite);
+unsigned int getNextFileBlockInto(unsigned char *dest);
+unsigned int getNextFileBlockToSink(byte_sink sink);
+unsigned long startFileBlockRead(unsigned int *length);
+unsigned char seekFile(unsigned long offset);
+unsigned char fillFileBuffer(void);
+void prepareFileBuffer(void);
+unsigned int readFileBytes(unsigned char *dest, unsigned int count);
+int readFileChar(void);
+unsigned int readFileLine(unsigned char *dest, unsigned int max, unsigned char delimiter);
+unsigned char writeBufferToFile(unsigned int bytesToWrite);
+unsigned char writeBlockToFile(unsigned char *src, unsigned int bytesToWrite);
+unsigned char writeSourceToFile(byte_source source, unsigned int bytesToWrite);
+unsigned char startFileBlockWrite(void);
+void endFileBlockWrite(unsigned int bytesToWrite);
+unsigned char advanceWriteCluster(void);
+unsigned char writeFileBytes(unsigned char *src, unsigned int count);
+unsigned char writeFileChar(unsigned char c);
+void syncFile(void);
 void closeFile();
 void makeShortFilename(unsigned char *longFilename, unsigned char *shortFilename);
+unsigned char nextDirectoryPosition (unsigned long *cluster, unsigned char *sector, unsigned int *entry);
+unsigned long extendDirectory (unsigned long lastCluster);
+void freeClusterChain (unsigned long cluster);
+void markAliasTail (unsigned char *name, unsigned char *alias, unsigned char *usedTails);
 
 void openDirectory(unsigned long firstCluster);
 
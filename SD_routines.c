@@ -29,6 +29,9 @@
 #include "SD_routines.h"
 #include "UART_routines.h"
 
+//TRAN_SPEED time values (x10), indexed by bits 6:3 of the CSD byte
+const unsigned char tranSpeedValue[16] PROGMEM = {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+
 //******************************************************************
 //Function	: to initialize the SD/SDHC card in SPI mode
 //Arguments	: none
@@ -40,6 +43,11 @@ unsigned char SD_init(void)
     unsigned char i, response, SD_version;
     unsigned int retry = 0 ;
 
+    SPI_SD;  //identification runs at the slow clock
+    _sdQueueHead = _sdQueueTail; //drop requests queued for a previous card
+    _streamMode = STREAM_NONE;
+    _bufferBlock = NO_BLOCK;
+
     for(i = 0; i < 10; i++)
         SPI_transmit(0xff);   //80 clock pulses spent before sending the first command
 
@@ -120,10 +128,96 @@ unsigned char SD_init(void)
     //SD_sendCommand(CRC_ON_OFF, OFF); //disable CRC; deafault - CRC disabled in SPI mode
     //SD_sendCommand(SET_BLOCK_LEN, 512); //set block size to 512; default size is 512
 
+    if(SD_readCardInfo())
+       return 3;  //CSD could not be read
 
     return 0; //successful return
 }
 
+//******************************************************************
+//Function	: to read the CSD register, keep the card parameters in
+//			  _cardInfo and switch the SPI clock to the fastest
+//			  divider that both the MCU and the card support
+//Arguments	: none
+//return	: unsigned char; will be 0 if no error,
+// 			  otherwise the response byte will be sent
+//******************************************************************
+unsigned char SD_readCardInfo(void)
+{
+unsigned char csd[16], response, i;
+unsigned long cSize, maxKHz;
+unsigned char divider;
+
+ response = SD_sendCommand(SEND_CSD, 0);
+
+ if(response != 0x00) return response;
+
+SD_CS_ASSERT;
+
+if(SD_waitStartToken()) //the CSD is sent as a 16 byte data block
+{
+  SD_CS_DEASSERT;
+  return 1;
+}
+
+for(i=0; i<16; i++)
+  csd[i] = SPI_receive();
+
+SPI_receive(); //CRC is ignored here
+SPI_receive();
+
+SD_CS_DEASSERT;
+
+//TRAN_SPEED: bits 2:0 rate unit (100kbit/s * 10^n), bits 6:3 time value
+maxKHz = pgm_read_byte(&tranSpeedValue[(csd[3] >> 3) & 0x0f]);
+for(i = 0; i <= (csd[3] & 0x07); i++)
+  maxKHz *= 10;
+_cardInfo.maxClockKHz = maxKHz;
+
+_cardInfo.csdVersion = csd[0] >> 6;
+if(_cardInfo.csdVersion == 1)
+{
+  //C_SIZE counts 512 KByte units
+  cSize = ((unsigned long)(csd[7] & 0x3f) << 16) | ((unsigned int)csd[8] << 8) | csd[9];
+  _cardInfo.totalBlocks = (cSize + 1) << 10;
+}
+else
+{
+  //capacity = (C_SIZE+1) * 2^(C_SIZE_MULT+2) * 2^READ_BL_LEN bytes
+  cSize = ((unsigned int)(csd[6] & 0x03) << 10) | ((unsigned int)csd[7] << 2) | (csd[8] >> 6);
+  i = (((csd[9] & 0x03) << 1) | (csd[10] >> 7)) + 2 + (csd[5] & 0x0f) - 9;
+  _cardInfo.totalBlocks = (cSize + 1) << i;
+}
+
+//fosc/2 is the fastest the SPI master can run
+divider = 2;
+while(divider < SPI_MAX_DIVIDER && (F_CPU / 1000) / divider > maxKHz)
+  divider <<= 1;
+
+_cardInfo.spiDivider = divider;
+SPI_setClockDivider(divider);
+
+return 0;
+}
+
+//******************************************************************
+//Function	: to fall back to the next slower SPI clock after a
+//			  failed transfer
+//Arguments	: none
+//return	: unsigned char; 1 if the clock was lowered, 0 if it
+// 			  already runs at the slowest divider
+//******************************************************************
+unsigned char SD_slowDown(void)
+{
+if(_cardInfo.spiDivider == 0 || _cardInfo.spiDivider >= SPI_MAX_DIVIDER)
+  return 0;
+
+_cardInfo.spiDivider <<= 1;
+SPI_setClockDivider(_cardInfo.spiDivider);
+
+return 1;
+}
+
 //******************************************************************
 //Function	: to send a command to SD card
 //Arguments	: unsigned char (8-bit command value)
@@ -134,6 +228,10 @@ unsigned char SD_sendCommand(unsigned char cmd, unsigned long arg)
 {
 unsigned char response, retry=0, status;
 
+//any other command has to close an open multiple block transaction first
+if(_streamMode != STREAM_NONE && cmd != STOP_TRANSMISSION)
+  SD_stopMultipleBlock();
+
 //SD card accepts byte address while SDHC accepts block address in multiples of 512
 //so, if it's SD card we need to convert block address into corresponding byte address by 
 //multipying it with 512. which is equivalent to shifting it left 9 times
@@ -163,7 +261,10 @@ if(cmd == SEND_IF_COND)	 //it is compulsory to send correct CRC for CMD8 (CRC=0x
 else 
   SPI_transmit(0x95); 
 
-while((response = SPI_receive()) == 0xff) //wait response
+if(cmd == STOP_TRANSMISSION) //the byte following CMD12 is a stuff byte
+  SPI_receive();
+
+while((response = SPI_receive()) & 0x80) //wait response, bit 7 is always 0 in R1
    if(retry++ > 0xfe) break; //time out error
 
 if(response == 0x00 && cmd == 58)  //checking response of CMD58
@@ -184,90 +285,697 @@ return response; //return state
 }
 
 //******************************************************************
-//Function	: to read a single block from SD card
-//Arguments	: none
+//Function	: to read a single block from SD card into _buffer
+//Arguments	: unsigned long block
 //return	: unsigned char; will be 0 if no error,
 // 			  otherwise the response byte will be sent
 //******************************************************************
 unsigned char SD_readSingleBlock(unsigned long startBlock)
 {
+return SD_readBlockInto(startBlock, (unsigned char *)_buffer);
+}
+
+//******************************************************************
+//Function	: to read a single block from SD card into any buffer
+//Arguments	: unsigned long block, unsigned char * 512 byte buffer
+//return	: unsigned char; will be 0 if no error,
+// 			  otherwise the response byte will be sent
+//******************************************************************
+unsigned char SD_readBlockInto(unsigned long startBlock, unsigned char *buffer)
+{
+return SD_waitRequest(SD_submitRead(startBlock, buffer));
+}
+
+//******************************************************************
+//Function	: to read a window of a single block, e.g. one FAT entry,
+//			  without a 512 byte buffer; the whole block is clocked
+//			  through and only bytes offset to offset+length-1 kept
+//Arguments	: unsigned long block, unsigned int offset, unsigned int
+//			  length, unsigned char * buffer of length bytes
+//return	: unsigned char; will be 0 if no error,
+// 			  otherwise the response byte will be sent
+//******************************************************************
+unsigned char SD_readWindow(unsigned long startBlock, unsigned int offset, unsigned int length, unsigned char *buffer)
+{
 unsigned char response;
-unsigned int i, retry=0;
+unsigned int i;
+
+SD_flushRequests(); //queued requests go to the card first
+
+while(1)
+{
+  response = SD_sendCommand(READ_SINGLE_BLOCK, startBlock); //read a Block command
+  if(response != 0x00) return response;
+
+  SD_CS_ASSERT;
+  if(!SD_waitStartToken()) break;
+  SD_CS_DEASSERT;
+
+  if(!SD_slowDown()) return 1; //time-out, try again on a slower clock
+}
+
+for(i=0; i<offset; i++)
+  SPI_receive();
+SPI_receiveBlock(buffer, length);
+for(i=offset+length; i<512; i++)
+  SPI_receive();
+
+SPI_receive(); //receive incoming CRC (16-bit), CRC is ignored here
+SPI_receive();
+
+SPI_receive(); //extra 8 clock pulses
+SD_CS_DEASSERT;
+
+return 0;
+}
+
+//******************************************************************
+//Function	: to wait for the start block token of a data block
+//Arguments	: none
+//return	: unsigned char; will be 0 if the token arrived, 1 on time-out
+//******************************************************************
+unsigned char SD_waitStartToken(void)
+{
+unsigned int retry=0;
+
+while(SPI_receive() != 0xfe) //wait for start block token 0xfe (0x11111110)
+  if(retry++ > 0xfffe) return 1; //time-out
+
+return 0;
+}
+
+//******************************************************************
+//Function	: to open a multiple block read transaction (CMD18), the
+//			  blocks are then read one at a time with SD_readNextBlock()
+//Arguments	: unsigned long start block, unsigned long number of blocks
+//			  (0 keeps the transaction open until SD_stopMultipleBlock())
+//return	: unsigned char; will be 0 if no error,
+// 			  otherwise the response byte will be sent
+//******************************************************************
+unsigned char SD_readMultipleBlock(unsigned long startBlock, unsigned long totalBlocks)
+{
+unsigned char response;
+
+SD_flushRequests();
+
+ response = SD_sendCommand(READ_MULTIPLE_BLOCKS, startBlock); //read multiple blocks command
 
- response = SD_sendCommand(READ_SINGLE_BLOCK, startBlock); //read a Block command
- 
  if(response != 0x00) return response; //check for SD status: 0x00 - OK (No flags set)
 
+_streamMode = STREAM_READ;
+_startBlock = startBlock;
+_totalBlocks = totalBlocks;
+
+return 0;
+}
+
+//******************************************************************
+//Function	: to read the next block of an open multiple block read
+//			  into _buffer, the transaction is stopped after its last block
+//Arguments	: none
+//return	: unsigned char; will be 0 if no error, otherwise 1
+//******************************************************************
+unsigned char SD_readNextBlock(void)
+{
+return SD_readNextBlockInto((unsigned char *)_buffer);
+}
+
+//******************************************************************
+//Function	: to read the next block of an open multiple block read
+//			  into any buffer, see SD_readNextBlock
+//Arguments	: unsigned char * 512 byte buffer
+//return	: unsigned char; will be 0 if no error, otherwise 1
+//******************************************************************
+unsigned char SD_readNextBlockInto(unsigned char *buffer)
+{
+if(_streamMode != STREAM_READ) return 1;
+
 SD_CS_ASSERT;
 
-retry = 0;
-while(SPI_receive() != 0xfe) //wait for start block token 0xfe (0x11111110)
-  if(retry++ > 0xfffe){SD_CS_DEASSERT; return 1;} //return if time-out
+while(SD_waitStartToken())
+{
+  SD_CS_DEASSERT;
+
+  //time-out, reopen the transaction at this block on a slower clock
+  if(!SD_slowDown() || SD_readMultipleBlock(_startBlock, _totalBlocks))
+  {
+    SD_stopMultipleBlock();
+    return 1;
+  }
+
+  SD_CS_ASSERT;
+}
 
-for(i=0; i<512; i++) //read 512 bytes
-  _buffer[i] = SPI_receive();
+SPI_receiveBlock(buffer, 512); //read 512 bytes
 
 SPI_receive(); //receive incoming CRC (16-bit), CRC is ignored here
 SPI_receive();
 
-SPI_receive(); //extra 8 clock pulses
 SD_CS_DEASSERT;
 
+if(buffer == _buffer) _bufferBlock = _startBlock;
+_startBlock++;
+if(_totalBlocks != 0 && --_totalBlocks == 0)
+  SD_stopMultipleBlock(); //all requested blocks are read
+
+return 0;
+}
+
+//******************************************************************
+//Function	: to read the next block of an open multiple block read
+//			  byte by byte into a sink, without a buffer; bytes past
+//			  count are dropped. See SD_readNextBlock
+//Arguments	: byte_sink, unsigned int bytes handed to it
+//return	: unsigned char; will be 0 if no error, otherwise 1
+//******************************************************************
+unsigned char SD_readNextBlockToSink(byte_sink sink, unsigned int count)
+{
+unsigned int i;
+
+if(_streamMode != STREAM_READ) return 1;
+
+SD_CS_ASSERT;
+
+while(SD_waitStartToken())
+{
+  SD_CS_DEASSERT;
+
+  //time-out, reopen the transaction at this block on a slower clock
+  if(!SD_slowDown() || SD_readMultipleBlock(_startBlock, _totalBlocks))
+  {
+    SD_stopMultipleBlock();
+    return 1;
+  }
+
+  SD_CS_ASSERT;
+}
+
+SPI_receiveToSink(sink, count);
+for(i=count; i<512; i++)
+  SPI_receive();
+
+SPI_receive(); //receive incoming CRC (16-bit), CRC is ignored here
+SPI_receive();
+
+SD_CS_DEASSERT;
+
+_startBlock++;
+if(_totalBlocks != 0 && --_totalBlocks == 0)
+  SD_stopMultipleBlock(); //all requested blocks are read
+
+return 0;
+}
+
+//******************************************************************
+//Function	: to close an open multiple block transaction
+//Arguments	: none
+//return	: unsigned char; will be 0 if no error,
+// 			  otherwise the response byte will be sent
+//******************************************************************
+unsigned char SD_stopMultipleBlock(void)
+{
+unsigned char response;
+unsigned int retry=0;
+
+if(_streamMode == STREAM_NONE) return 0;
+
+if(_streamMode == STREAM_WRITE)
+{
+  _streamMode = STREAM_NONE;
+  response = 0;
+
+  SD_CS_ASSERT;
+  while(!SPI_receive()) //wait for the last block to be programmed
+    if(retry++ > 0xfffe) break;
+
+  SPI_transmit(0xfd); //stop transmission token
+  SPI_receive();      //the card needs a byte before signalling busy
+  retry = 0;
+}
+else
+{
+  _streamMode = STREAM_NONE;
+  response = SD_sendCommand(STOP_TRANSMISSION, 0);
+  SD_CS_ASSERT;
+}
+
+while(!SPI_receive()) //wait for the card to get idle
+  if(retry++ > 0xfffe) break;
+SD_CS_DEASSERT;
+
+return response;
+}
+
+//******************************************************************
+//Function	: to open a multiple block write transaction (CMD25), the
+//			  blocks are then written one at a time from _buffer with
+//			  SD_writeNextBlock()
+//Arguments	: unsigned long start block, unsigned long number of blocks
+//			  (0 if not known, otherwise it is sent to the card with
+//			  ACMD23 to pre-erase the blocks)
+//return	: unsigned char; will be 0 if no error,
+// 			  otherwise the response byte will be sent
+//******************************************************************
+unsigned char SD_writeMultipleBlock(unsigned long startBlock, unsigned long totalBlocks)
+{
+unsigned char response;
+
+SD_flushRequests();
+
+if(totalBlocks != 0)
+{
+  SD_sendCommand(APP_CMD, 0); //CMD55, must be sent before sending any ACMD command
+  SD_sendCommand(SET_WR_BLK_ERASE_COUNT, totalBlocks); //ACMD23
+}
+
+ response = SD_sendCommand(WRITE_MULTIPLE_BLOCKS, startBlock); //write multiple blocks command
+
+ if(response != 0x00) return response; //check for SD status: 0x00 - OK (No flags set)
+
+_streamMode = STREAM_WRITE;
+_startBlock = startBlock;
+_totalBlocks = totalBlocks;
+
 return 0;
 }
 
 //******************************************************************
-//Function	: to write to a single block of SD card
+//Function	: to write _buffer as the next block of an open multiple
+//			  block write, the card is left programming it; the
+//			  transaction is stopped after its last block
 //Arguments	: none
 //return	: unsigned char; will be 0 if no error,
 // 			  otherwise the response byte will be sent
 //******************************************************************
+unsigned char SD_writeNextBlock(void)
+{
+return SD_writeNextBlockFrom((unsigned char *)_buffer);
+}
+
+//******************************************************************
+//Function	: to write any buffer as the next block of an open multiple
+//			  block write, see SD_writeNextBlock
+//Arguments	: unsigned char * 512 byte buffer
+//return	: unsigned char; will be 0 if no error,
+// 			  otherwise the response byte will be sent
+//******************************************************************
+unsigned char SD_writeNextBlockFrom(unsigned char *buffer)
+{
+unsigned char response;
+unsigned int retry;
+
+if(_streamMode != STREAM_WRITE) return 1;
+
+while(1)
+{
+  SD_CS_ASSERT;
+
+  retry = 0;
+  while(!SPI_receive()) //wait for the previous block to be programmed
+    if(retry++ > 0xfffe){SD_CS_DEASSERT; return 1;}
+
+  SPI_transmit(0xfc);     //Send start block token 0xfc (0x11111100) for multiple block write
+
+  SPI_transmitBlock(buffer, 512);    //send 512 bytes data
+
+  SPI_transmit(0xff);     //transmit dummy CRC (16-bit), CRC is ignored here
+  SPI_transmit(0xff);
+
+  response = SPI_receive();
+  SD_CS_DEASSERT;
+
+  if( (response & 0x1f) == 0x05) //data accepted
+    break;
+
+  //data rejected, send the block again in a new transaction on a slower clock
+  if(!SD_slowDown() || SD_writeMultipleBlock(_startBlock, _totalBlocks))
+  {
+    SD_stopMultipleBlock();
+    return response;
+  }
+}
+
+if(buffer == _buffer) _bufferBlock = _startBlock;
+else if(_bufferBlock == _startBlock) _bufferBlock = NO_BLOCK; //_buffer is out of date
+_startBlock++;
+if(_totalBlocks != 0 && --_totalBlocks == 0)
+  SD_stopMultipleBlock(); //all announced blocks are written
+
+return 0;
+}
+
+//******************************************************************
+//Function	: to write the next block of an open multiple block write
+//			  byte by byte from a source, without a buffer; the block
+//			  is padded with 0 after count bytes. The source can't be
+//			  rewound, so a rejected block is not sent again
+//Arguments	: byte_source, unsigned int bytes taken from it
+//return	: unsigned char; will be 0 if no error,
+// 			  otherwise the response byte will be sent
+//******************************************************************
+unsigned char SD_writeNextBlockFromSource(byte_source source, unsigned int count)
+{
+unsigned char response;
+unsigned int i, retry;
+
+if(_streamMode != STREAM_WRITE) return 1;
+
+SD_CS_ASSERT;
+
+retry = 0;
+while(!SPI_receive()) //wait for the previous block to be programmed
+  if(retry++ > 0xfffe){SD_CS_DEASSERT; return 1;}
+
+SPI_transmit(0xfc);     //Send start block token 0xfc (0x11111100) for multiple block write
+
+SPI_transmitFromSource(source, count);
+for(i=count; i<512; i++)
+  SPI_transmit(0);
+
+SPI_transmit(0xff);     //transmit dummy CRC (16-bit), CRC is ignored here
+SPI_transmit(0xff);
+
+response = SPI_receive();
+SD_CS_DEASSERT;
+
+if( (response & 0x1f) != 0x05) //data rejected
+{
+  SD_stopMultipleBlock();
+  return response;
+}
+
+if(_bufferBlock == _startBlock) _bufferBlock = NO_BLOCK; //_buffer is out of date
+_startBlock++;
+if(_totalBlocks != 0 && --_totalBlocks == 0)
+  SD_stopMultipleBlock(); //all announced blocks are written
+
+return 0;
+}
+
+//******************************************************************
+//Function	: to write _buffer to a single block of SD card; returns
+//			  as soon as the card has accepted the data, the next
+//			  command waits for it to finish programming
+//Arguments	: unsigned long block
+//return	: unsigned char; will be 0 if no error,
+// 			  otherwise the response byte will be sent
+//******************************************************************
 unsigned char SD_writeSingleBlock(unsigned long startBlock)
 {
-    unsigned char response;
-    unsigned int i, retry=0;
+    return SD_writeBlockFrom(startBlock, (unsigned char *)_buffer);
+}
 
-    response = SD_sendCommand(WRITE_SINGLE_BLOCK, startBlock); //write a Block command
-  
-    if(response != 0x00)
-        return response; //check for SD status: 0x00 - OK (No flags set)
+//******************************************************************
+//Function	: to write any buffer to a single block of SD card, see
+//			  SD_writeSingleBlock
+//Arguments	: unsigned long block, unsigned char * 512 byte buffer
+//return	: unsigned char; will be 0 if no error,
+// 			  otherwise the response byte will be sent
+//******************************************************************
+unsigned char SD_writeBlockFrom(unsigned long startBlock, unsigned char *buffer)
+{
+    unsigned char handle;
 
-    SD_CS_ASSERT;
+    handle = SD_submitWrite(startBlock, buffer);
 
-    SPI_transmit(0xfe);     //Send start block token 0xfe (0x11111110)
+    while(SD_requestState(handle) == SD_REQ_PENDING)
+        SD_poll();
 
-    for(i=0; i<512; i++)    //send 512 bytes data
-        SPI_transmit(_buffer[i]);
+    if(SD_requestState(handle) == SD_REQ_ERROR)
+        return SD_collectError(handle);
 
-    SPI_transmit(0xff);     //transmit dummy CRC (16-bit), CRC is ignored here
-    SPI_transmit(0xff);
+    return 0;
+}
+
+//******************************************************************
+//Function	: to queue a block transfer, it is carried out by SD_poll();
+//			  if the queue is full the oldest request is finished first
+//Arguments	: unsigned long block, unsigned char * 512 byte buffer,
+//			  unsigned char 1 for a write, 0 for a read
+//return	: unsigned char; handle of the request
+//******************************************************************
+unsigned char SD_submitRequest(unsigned long startBlock, unsigned char *buffer, unsigned char write)
+{
+volatile sd_request *req;
+unsigned char handle;
+
+while((unsigned char)(_sdQueueTail - _sdQueueHead) >= SD_QUEUE_LENGTH)
+  SD_poll();
+
+handle = _sdQueueTail;
+req = &_sdQueue[handle & (SD_QUEUE_LENGTH-1)];
+
+if(_sdErrorPending && _sdErrorHandle == handle)
+  _sdErrorPending = 0; //the handle has come round again, too late to collect
+
+if(req->state == SD_REQ_ERROR && !_sdErrorPending)
+{
+  _sdErrorHandle = req->handle; //keep the error until it is collected
+  _sdErrorResponse = req->response;
+  _sdErrorPending = 1;
+}
 
-    response = SPI_receive();
+req->handle = handle;
+req->write = write;
+req->block = startBlock;
+req->buffer = buffer;
+req->response = 0;
+req->retry = 0;
+req->state = SD_REQ_PENDING;
+_sdQueueTail++;
 
-    if( (response & 0x1f) != 0x05) //response= 0xXXX0AAA1 ; AAA='010' - data accepted
-    {                              //AAA='101'-data rejected due to CRC error
-        SD_CS_DEASSERT;              //AAA='110'-data rejected due to write error
-        return response;
+SD_poll(); //start it right away if the card is free
+
+return handle;
+}
+
+//******************************************************************
+//Function	: to queue reading a block into a buffer
+//Arguments	: unsigned long block, unsigned char * 512 byte buffer
+//return	: unsigned char; handle of the request
+//******************************************************************
+unsigned char SD_submitRead(unsigned long startBlock, unsigned char *buffer)
+{
+return SD_submitRequest(startBlock, buffer, 0);
+}
+
+//******************************************************************
+//Function	: to queue writing a buffer to a block; the buffer may be
+//			  reused once the request has left the SD_REQ_PENDING state
+//Arguments	: unsigned long block, unsigned char * 512 byte buffer
+//return	: unsigned char; handle of the request
+//******************************************************************
+unsigned char SD_submitWrite(unsigned long startBlock, unsigned char *buffer)
+{
+return SD_submitRequest(startBlock, buffer, 1);
+}
+
+//******************************************************************
+//Function	: to get the state of a queued request; a failed request
+//			  stays in SD_REQ_ERROR until SD_collectError is called
+//			  for it, also once its slot is reused
+//Arguments	: unsigned char handle
+//return	: unsigned char; SD_REQ_xxx state
+//******************************************************************
+unsigned char SD_requestState(unsigned char handle)
+{
+volatile sd_request *req = &_sdQueue[handle & (SD_QUEUE_LENGTH-1)];
+
+if(req->handle != handle) //slot reused, the request finished long ago
+{
+  if(_sdErrorPending && _sdErrorHandle == handle)
+    return SD_REQ_ERROR;
+  return SD_REQ_DONE;
+}
+
+return req->state;
+}
+
+//******************************************************************
+//Function	: to take the error of a failed request, after which its
+//			  state is SD_REQ_DONE. Only the first error not collected
+//			  is kept once the slot of the request is reused
+//Arguments	: unsigned char handle
+//return	: unsigned char; will be 0 if the request didn't fail,
+// 			  otherwise the response byte will be sent
+//******************************************************************
+unsigned char SD_collectError(unsigned char handle)
+{
+volatile sd_request *req = &_sdQueue[handle & (SD_QUEUE_LENGTH-1)];
+unsigned char response = 0;
+
+if(req->handle == handle)
+{
+  if(req->state == SD_REQ_ERROR)
+  {
+    response = req->response;
+    req->state = SD_REQ_DONE;
+  }
+}
+else if(_sdErrorPending && _sdErrorHandle == handle)
+{
+  response = _sdErrorResponse;
+  _sdErrorPending = 0;
+}
+
+return response;
+}
+
+//******************************************************************
+//Function	: to drive queued requests until one has finished
+//Arguments	: unsigned char handle
+//return	: unsigned char; will be 0 if no error,
+// 			  otherwise the response byte will be sent
+//******************************************************************
+unsigned char SD_waitRequest(unsigned char handle)
+{
+unsigned char state;
+
+while((state = SD_requestState(handle)) != SD_REQ_DONE && state != SD_REQ_ERROR)
+  SD_poll();
+
+if(state == SD_REQ_ERROR)
+  return SD_collectError(handle);
+
+return 0;
+}
+
+//******************************************************************
+//Function	: to finish all queued requests
+//Arguments	: none
+//return	: none
+//******************************************************************
+void SD_flushRequests(void)
+{
+while(SD_poll());
+}
+
+//******************************************************************
+//Function	: to advance the oldest queued request by one step without
+//			  waiting on the card; call it from the main loop or a
+//			  timer tick that doesn't interrupt other SD calls
+//Arguments	: none
+//return	: unsigned char; number of requests still queued
+//******************************************************************
+unsigned char SD_poll(void)
+{
+volatile sd_request *req;
+unsigned char response, i;
+
+if(_sdQueueHead == _sdQueueTail) return 0;
+
+req = &_sdQueue[_sdQueueHead & (SD_QUEUE_LENGTH-1)];
+
+switch(req->state)
+{
+  case SD_REQ_PENDING:
+    if(!req->write)
+    {
+      response = SD_sendCommand(READ_SINGLE_BLOCK, req->block); //read a Block command
+
+      if(response == 0x00)
+      {
+        SD_CS_ASSERT; //held until the data is in, see SD_REQ_WAIT_TOKEN
+        req->state = SD_REQ_WAIT_TOKEN;
+        req->retry = 0;
+      }
     }
+    else
+    {
+      response = SD_sendCommand(WRITE_SINGLE_BLOCK, req->block); //write a Block command
 
-    while(!SPI_receive()) //wait for SD card to complete writing and get idle
-        if(retry++ > 0xfffe)
-        {
-            SD_CS_DEASSERT;
-            return 1;
-        }
+      if(response == 0x00)
+      {
+        SD_CS_ASSERT;
 
-    SD_CS_DEASSERT;
-    SPI_transmit(0xff);   //just spend 8 clock cycle delay before reasserting the CS line
-    SD_CS_ASSERT;         //re-asserting the CS line to verify if card is still busy
+        SPI_transmit(0xfe);     //Send start block token 0xfe (0x11111110)
 
-    while(!SPI_receive()) //wait for SD card to complete writing and get idle
-        if(retry++ > 0xfffe)
+        SPI_transmitBlock(req->buffer, 512);    //send 512 bytes data
+
+        SPI_transmit(0xff);     //transmit dummy CRC (16-bit), CRC is ignored here
+        SPI_transmit(0xff);
+
+        response = SPI_receive();
+        SD_CS_DEASSERT;
+
+        if( (response & 0x1f) == 0x05) //response= 0xXXX0AAA1 ; AAA='010' - data accepted
+        {                              //AAA='101'-data rejected due to CRC error
+          req->state = SD_REQ_PROGRAMMING; //AAA='110'-data rejected due to write error
+          req->retry = 0;
+          response = 0;
+
+          if(req->buffer == _buffer) _bufferBlock = req->block;
+          else if(_bufferBlock == req->block) _bufferBlock = NO_BLOCK; //_buffer is out of date
+        }
+        else if(SD_slowDown())
         {
-            SD_CS_DEASSERT;
-            return 1;
+          response = 0; //send it again on a slower clock
         }
+      }
+    }
+
+    if(response != 0x00)
+    {
+      req->response = response;
+      req->state = SD_REQ_ERROR;
+    }
+    break;
+
+  case SD_REQ_WAIT_TOKEN: //CS stays asserted from the command to the data
+    for(i=0; i<16; i++) //look at a few bytes per step
+    {
+      response = SPI_receive();
+      if(response == 0xfe) //start block token 0xfe (0x11111110)
+      {
+        SPI_receiveBlock(req->buffer, 512); //read 512 bytes
+
+        SPI_receive(); //receive incoming CRC (16-bit), CRC is ignored here
+        SPI_receive();
+
+        SPI_receive(); //extra 8 clock pulses
+        req->state = SD_REQ_DONE;
+
+        if(req->buffer == _buffer) _bufferBlock = req->block;
+        break;
+      }
+    }
+
+    if(req->state == SD_REQ_WAIT_TOKEN && (req->retry += 16) >= 0xfff0)
+    {
+      if(SD_slowDown()) //time-out, try again on a slower clock
+      {
+        req->state = SD_REQ_PENDING;
+      }
+      else
+      {
+        req->response = 1;
+        req->state = SD_REQ_ERROR;
+      }
+    }
+
+    if(req->state != SD_REQ_WAIT_TOKEN)
+      SD_CS_DEASSERT;
+    break;
+
+  case SD_REQ_PROGRAMMING:
+    SD_CS_ASSERT;
+    response = SPI_receive(); //the card holds the line low while it is busy
     SD_CS_DEASSERT;
 
-    return 0;
+    if(response != 0x00)
+    {
+      req->state = SD_REQ_DONE;
+    }
+    else if(++req->retry > 0xfffe)
+    {
+      req->response = 1;
+      req->state = SD_REQ_ERROR;
+    }
+    break;
+}
+
+if(req->state == SD_REQ_DONE || req->state == SD_REQ_ERROR)
+  _sdQueueHead++;
+
+return (unsigned char)(_sdQueueTail - _sdQueueHead);
 }
@@ -26,6 +26,125 @@
 #include <avr/io.h>
 #include "SPI_routines.h"
 
+#if SPI_TRANSPORT == SPI_TRANSPORT_USART
+
+//USART0 in master SPI mode (MSPIM) initialize for SD card
+//clock rate: fosc/SPI_MAX_DIVIDER
+void spi_init(void)
+{
+UBRR0 = 0;
+DDRD |= (1<<PD4);   //XCK0 as output makes the USART the SPI master
+UCSR0C = (1<<UMSEL01)|(1<<UMSEL00); //MSPIM, MSB first, SCK phase low, SCK idle low
+UCSR0B = (1<<RXEN0)|(1<<TXEN0);
+UBRR0 = (SPI_MAX_DIVIDER / 2) - 1;  //baud rate is set after enabling the transmitter
+}
+
+//set the SPI clock to fosc/divider
+//divider: power of 2 from 2 (fastest) to SPI_MAX_DIVIDER
+void SPI_setClockDivider(unsigned char divider)
+{
+UBRR0 = (divider / 2) - 1; //fosc/(2*(UBRR0+1))
+}
+
+unsigned char SPI_transmit(unsigned char data)
+{
+// Start transmission
+while(!(UCSR0A & (1<<UDRE0)));
+UDR0 = data;
+
+// Every byte sent clocks one in
+while(!(UCSR0A & (1<<RXC0)));
+data = UDR0;
+
+return(data);
+}
+
+unsigned char SPI_receive(void)
+{
+return SPI_transmit(0xff);
+}
+
+//send a block of bytes; the transmit register is double buffered, so
+//the next byte is loaded while the last one is still going out. Every
+//byte sent clocks one in, which is dropped before the next is loaded,
+//so the function returns once the last byte is out
+void SPI_transmitBlock(unsigned char *data, unsigned int count)
+{
+if(count == 0) return;
+
+UDR0 = *data++;
+while(--count)
+{
+  while(!(UCSR0A & (1<<UDRE0)));
+  UDR0 = *data++;
+  while(!(UCSR0A & (1<<RXC0)));
+  (void)UDR0;
+}
+
+while(!(UCSR0A & (1<<RXC0)));
+(void)UDR0;
+}
+
+//receive a block of bytes, one 0xff is always queued ahead so the
+//clock runs without gaps
+void SPI_receiveBlock(unsigned char *data, unsigned int count)
+{
+if(count == 0) return;
+
+UDR0 = 0xff;
+while(--count)
+{
+  while(!(UCSR0A & (1<<UDRE0)));
+  UDR0 = 0xff;
+  while(!(UCSR0A & (1<<RXC0)));
+  *data++ = UDR0;
+}
+
+while(!(UCSR0A & (1<<RXC0)));
+*data = UDR0;
+}
+
+//receive a block of bytes into a sink, see SPI_receiveBlock
+void SPI_receiveToSink(byte_sink sink, unsigned int count)
+{
+if(count == 0) return;
+
+UDR0 = 0xff;
+while(--count)
+{
+  while(!(UCSR0A & (1<<UDRE0)));
+  UDR0 = 0xff;
+  while(!(UCSR0A & (1<<RXC0)));
+  sink(UDR0);
+}
+
+while(!(UCSR0A & (1<<RXC0)));
+sink(UDR0);
+}
+
+//transmit a block of bytes taken from a source, see SPI_transmitBlock
+void SPI_transmitFromSource(byte_source source, unsigned int count)
+{
+unsigned char next;
+
+if(count == 0) return;
+
+UDR0 = source();
+while(--count)
+{
+  next = source();
+  while(!(UCSR0A & (1<<UDRE0)));
+  UDR0 = next;
+  while(!(UCSR0A & (1<<RXC0)));
+  (void)UDR0;
+}
+
+while(!(UCSR0A & (1<<RXC0)));
+(void)UDR0;
+}
+
+#else
+
 //SPI initialize for SD card
 //clock rate: 125Khz
 void spi_init(void)
@@ -34,6 +153,26 @@ SPCR = 0x52; //setup SPI: Master mode, MSB first, SCK phase low, SCK idle low
 SPSR = 0x00;
 }
 
+//set the SPI clock to fosc/divider
+//divider: power of 2 from 2 (fastest) to SPI_MAX_DIVIDER
+void SPI_setClockDivider(unsigned char divider)
+{
+unsigned char rate = 0;
+
+while(divider > 4 && rate < 3) //SPR1:SPR0 select fosc/4, 16, 64 or 128
+{
+  divider >>= 2;
+  rate++;
+}
+
+SPCR = 0x50 | rate; //Master mode, MSB first, SCK phase low, SCK idle low
+
+if(divider == 2 && rate < 3) //SPI2X doubles the rates below fosc/128
+  SPSR |= (1<<SPI2X);
+else
+  SPSR &= ~(1<<SPI2X);
+}
+
 unsigned char SPI_transmit(unsigned char data)
 {
 // Start transmission
@@ -58,3 +197,88 @@ data = SPDR;
 // Return data register
 return data;
 }
+
+//send a block of bytes; the next byte is fetched while the previous one
+//is shifted out, and written to SPDR as soon as SPIF is set. At fosc/2 the
+//loop is shorter than the 16 cycles a byte takes on the bus
+void SPI_transmitBlock(unsigned char *data, unsigned int count)
+{
+unsigned char next;
+
+if(count == 0) return;
+
+SPDR = *data++;
+while(--count)
+{
+  next = *data++;
+  while(!(SPSR & (1<<SPIF)));
+  SPDR = next;
+}
+
+while(!(SPSR & (1<<SPIF)));
+(void)SPDR; //clears SPIF
+}
+
+//receive a block of bytes; each byte is stored while the next one is
+//being clocked in, the next transfer starts right after SPDR is read
+void SPI_receiveBlock(unsigned char *data, unsigned int count)
+{
+unsigned char in;
+
+if(count == 0) return;
+
+SPDR = 0xff;
+while(--count)
+{
+  while(!(SPSR & (1<<SPIF)));
+  in = SPDR;
+  SPDR = 0xff;
+  *data++ = in;
+}
+
+while(!(SPSR & (1<<SPIF)));
+*data = SPDR;
+}
+
+//receive a block of bytes into a sink; each byte is handed over while
+//the next one is being clocked in
+void SPI_receiveToSink(byte_sink sink, unsigned int count)
+{
+unsigned char in;
+
+if(count == 0) return;
+
+SPDR = 0xff;
+while(--count)
+{
+  while(!(SPSR & (1<<SPIF)));
+  in = SPDR;
+  SPDR = 0xff;
+  sink(in);
+}
+
+while(!(SPSR & (1<<SPIF)));
+sink(SPDR);
+}
+
+//transmit a block of bytes taken from a source; the next byte is
+//fetched while the current one is being sent
+void SPI_transmitFromSource(byte_source source, unsigned int count)
+{
+unsigned char next;
+
+if(count == 0) return;
+
+SPDR = source();
+while(--count)
+{
+  next = source();
+  while(!(SPSR & (1<<SPIF)));
+  SPDR = next;
+}
+
+while(!(SPSR & (1<<SPIF)));
+(void)SPDR; //clears SPIF
+}
+
+#endif
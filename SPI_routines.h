@@ -26,12 +26,44 @@
 #ifndef _SPI_ROUTINES_H_
 #define _SPI_ROUTINES_H_
 
-#define SPI_SD             SPCR = 0x52
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
+//transport to the SD card: the SPI port, or USART0 as SPI master (MSPIM).
+//The USART transmit register is double buffered, so block transfers go
+//out without a gap between bytes. MSPIM needs the card on XCK0 (PD4),
+//TXD0 (PD1) and RXD0 (PD0), and the serial port routines are left out
+#define SPI_TRANSPORT_SPI      0
+#define SPI_TRANSPORT_USART    1
+
+#ifndef SPI_TRANSPORT
+#define SPI_TRANSPORT      SPI_TRANSPORT_SPI
+#endif
+
+//slowest clock divider used, fosc/128
+#define SPI_MAX_DIVIDER    128
+
+#if SPI_TRANSPORT == SPI_TRANSPORT_USART
+#define SPI_SD             SPI_setClockDivider(SPI_MAX_DIVIDER)
+#define SPI_HIGH_SPEED     SPI_setClockDivider(2)
+#else
+#define SPI_SD             SPCR = 0x52; SPSR &= ~(1<<SPI2X)
 #define SPI_HIGH_SPEED     SPCR = 0x50; SPSR |= (1<<SPI2X)
+#endif
 
+//per byte consumer and producer of the data of a block transfer, called
+//while the next byte is being clocked
+typedef void (*byte_sink)(unsigned char);
+typedef unsigned char (*byte_source)(void);
 
 void spi_init(void);
+void SPI_setClockDivider(unsigned char divider);
 unsigned char SPI_transmit(unsigned char);
 unsigned char SPI_receive(void);
+void SPI_transmitBlock(unsigned char *data, unsigned int count);
+void SPI_receiveBlock(unsigned char *data, unsigned int count);
+void SPI_receiveToSink(byte_sink sink, unsigned int count);
+void SPI_transmitFromSource(byte_source source, unsigned int count);
 
 #endif
@@ -22,9 +22,13 @@
 */
 
 #include "UART_routines.h"
+#include "SPI_routines.h"
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 
+//with the SD card on USART0 (SPI_TRANSPORT_USART) there is no serial port,
+//the routines below leave USART0 alone and output is dropped
+
 //**************************************************
 //UART0 initialize
 //baud rate: 19200  (for controller clock = 8MHz)
@@ -33,6 +37,7 @@
 //**************************************************
 void uart0_init(unsigned int ubrr)
 {
+#if SPI_TRANSPORT != SPI_TRANSPORT_USART
 /*
  UCSR0B = 0x00; //disable while setting baud rate
  UCSR0A = 0x00;
@@ -52,6 +57,7 @@ void uart0_init(unsigned int ubrr)
  UCSR0A = 0x00;
  UCSR0B = (1<<RXEN0)|(1<<TXEN0);
  UCSR0C = (1<<USBS0)|(3<<UCSZ00);
+#endif
  
  
 }
@@ -61,12 +67,14 @@ void uart0_init(unsigned int ubrr)
 //*************************************************
 unsigned char receiveByte( void )
 {
-	unsigned char data;
+	unsigned char data = 0;
 	
+#if SPI_TRANSPORT != SPI_TRANSPORT_USART
 	while(!(UCSR0A & (1<<RXC0))); 	// Wait for incomming data
 	
 	//status = UCSR0A;
 	data = UDR0;
+#endif
 	
 	return(data);
 }
@@ -75,9 +83,11 @@ unsigned char receiveByte( void )
 //***************************************************
 void transmitByte( unsigned char data )
 {
+#if SPI_TRANSPORT != SPI_TRANSPORT_USART
 	while ( !(UCSR0A & (1<<UDRE0)) )
 		; 			                /* Wait for empty transmit buffer */
 	UDR0 = data; 			        /* Start transmition */
+#endif
 }
 
 
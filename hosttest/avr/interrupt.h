@@ -0,0 +1,3 @@
+/* host stand-in for <avr/interrupt.h> */
+#define cli()
+#define sei()
@@ -0,0 +1,33 @@
+/* host stand-in for <avr/io.h>: the registers the library touches, kept
+   as plain variables defined in sdemu.c */
+#ifndef FAKE_AVR_IO_H
+#define FAKE_AVR_IO_H
+#include <stdint.h>
+#include <string.h>
+extern volatile unsigned char PORTB, DDRB, PORTD, DDRD, SPCR, SPSR, SPDR, MCUCR;
+extern volatile unsigned char UCSR0A, UCSR0B, UCSR0C, UDR0, UBRR0H, UBRR0L;
+extern volatile uint16_t UBRR0;
+#define SPIF 7
+#define SPI2X 0
+#define SPE 6
+#define MSTR 4
+#define SPR0 0
+#define SPR1 1
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define USBS0 3
+#define UCSZ00 1
+#define UMSEL00 6
+#define UMSEL01 7
+#define UCPHA0 1
+#define UCPOL0 0
+#define UDORD0 2
+#define DDD4 4
+#define PD4 4
+#define DDD1 1
+#define RAMEND 0x10FF
+char *strupr(char *s);
+#endif
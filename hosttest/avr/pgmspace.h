@@ -0,0 +1,4 @@
+/* host stand-in for <avr/pgmspace.h>, flash is ordinary memory here */
+#define PSTR(x) (x)
+#define pgm_read_byte(p) (*(const unsigned char *)(p))
+#define PROGMEM
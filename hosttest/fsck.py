@@ -0,0 +1,74 @@
+# usage: fsck.py card.img [path out.file]
+# checks the FAT32 file system on a card image: chains, cross links, long
+# name checksums and the FSinfo free count; exits 1 on an error
+import struct, sys
+img=open(sys.argv[1],'rb').read()
+part=struct.unpack_from('<I',img,446+8)[0]
+def S(n): return (part+n)*512
+bps,spc,res,nf=struct.unpack_from('<HBHB',img,S(0)+11)
+fatsz=struct.unpack_from('<I',img,S(0)+36)[0]; root=struct.unpack_from('<I',img,S(0)+44)[0]
+tot=struct.unpack_from('<I',img,S(0)+32)[0]
+fd=res+nf*fatsz; clus=(tot-fd)//spc
+fat=list(struct.unpack_from('<%dI'%(clus+2),img,S(res)))
+fat2=list(struct.unpack_from('<%dI'%(clus+2),img,S(res+fatsz)))
+def c2s(c): return fd+(c-2)*spc
+def chain(c):
+    out=[]; seen=set()
+    while 2<=c<0x0ffffff8:
+        if c in seen: raise Exception('loop')
+        seen.add(c); out.append(c); c=fat[c]&0x0fffffff
+    if c<0x0ffffff8: raise Exception('bad chain end %x'%c)
+    return out
+def readchain(c,size=None):
+    d=b''.join(img[S(c2s(x)):S(c2s(x))+spc*512] for x in chain(c))
+    return d if size is None else d[:size]
+used={}
+errors=[]
+files={}
+def walk(dc,path):
+    d=readchain(dc); lfn={}; chk=None
+    for i in range(0,len(d),32):
+        e=d[i:i+32]
+        if e[0]==0: break
+        if e[0]==0xe5: lfn={}; continue
+        if e[11]==0x0f:
+            o=e[0]&0x1f; s=b''.join(e[a:b] for a,b in ((1,11),(14,26),(28,32)))
+            lfn[o]=s.decode('utf-16le',errors='replace'); chk=e[13]; continue
+        name=e[0:11]
+        s=0
+        for ch in name: s=(((s&1)<<7)+(s>>1)+ch)&0xff
+        ln=None
+        if lfn:
+            if chk!=s: errors.append('lfn checksum mismatch '+repr(name))
+            ln=''.join(lfn[k] for k in sorted(lfn)).split('\0')[0]
+        lfn={}
+        c=(struct.unpack_from('<H',e,20)[0]<<16)|struct.unpack_from('<H',e,26)[0]
+        size=struct.unpack_from('<I',e,28)[0]
+        if name[0:1]==b'.': continue
+        nm=name[:8].decode().rstrip()+('.'+name[8:].decode().rstrip() if name[8:].strip() else '')
+        full=path+'/'+(ln or nm)
+        if c:
+            try: cs=chain(c)
+            except Exception as ex: errors.append(full+' '+str(ex)); continue
+            for x in cs:
+                if x in used: errors.append('crosslink %d %s %s'%(x,used[x],full))
+                used[x]=full
+            if not (e[11]&0x10) and len(cs)*spc*512 < size: errors.append(full+' chain too short')
+        files[full]=(e[11],c,size,nm)
+        if e[11]&0x10: walk(c,full)
+for x in chain(root): used[x]='/'
+walk(root,'')
+lost=[c for c in range(2,clus+2) if fat[c] and c not in used]
+free=sum(1 for c in range(2,clus+2) if fat[c]==0)
+fs=struct.unpack_from('<III',img,S(1)+484)
+print('files:')
+for k,v in sorted(files.items()): print('  %-40s attr=%02x cl=%d size=%d short=%s'%(k,v[0],v[1],v[2],v[3]))
+print('lost clusters',len(lost), lost[:10])
+print('free',free,'fsinfo free',fs[1],'next',fs[2])
+print('fat2 differs' if fat!=fat2 else 'fat mirrors equal')
+if fs[1]!=free: errors.append('fsinfo free count %d, the FAT has %d'%(fs[1],free))
+for e in errors: print('ERROR',e)
+if len(sys.argv)>2:
+    name=sys.argv[2]; a,c,size,_=files[name]
+    open(sys.argv[3],'wb').write(readchain(c,size))
+if errors: sys.exit(1)
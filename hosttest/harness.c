@@ -0,0 +1,151 @@
+/*
+    harness.c
+    host test of the library against the SD card emulated in sdemu.c
+
+    usage: harness card.img out.img
+    V=1 shows the UART output and the commands the card gets. The card has
+    a 25 MHz CSD 2.0, CSD1=1 gives it a 2 MHz CSD 1.0 and MAXKHZ=n makes it
+    fail transfers above n kHz. DIVIDER=n checks the SPI clock divider in
+    use at the end. The exit status is the number of failed checks
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#undef EOF      //FAT32.h has its own, the end of chain mark
+#include "avr/io.h"
+#include "SPI_routines.h"
+#include "SD_routines.h"
+#include "FAT32.h"
+
+//card image and statistics of the emulator in sdemu.c
+extern uint8_t *img;
+extern uint32_t nblocks;
+extern int verbose;
+extern int emu_max_khz;
+extern unsigned long st_cmd[64], st_bytes, st_busy, st_rd_blocks, st_wr_blocks, st_acmd23;
+extern uint8_t csd[16];
+
+//CSD 2.0, 25 MHz
+static const uint8_t csd2[16] = {0x40, 0x0e, 0x00, 0x32, 0x5b, 0x59, 0x00, 0x00,
+                                 0x76, 0xb2, 0x7f, 0x80, 0x0a, 0x40, 0x00, 0x01};
+//CSD 1.0, 2 MHz
+static const uint8_t csd1[16] = {0x00, 0x26, 0x00, 0x29, 0x5f, 0x59, 0x83, 0xc8,
+                                 0xbe, 0xfb, 0xcf, 0xff, 0x92, 0x40, 0x40, 0xd7};
+
+static int failures;
+
+//commands the card got since the last reset
+static unsigned long commands(void)
+{
+    unsigned long n = 0;
+    int i;
+
+    for (i = 0; i < 64; i++)
+        n += st_cmd[i];
+
+    return n;
+}
+
+//prints what the card did since the last reset
+static void stats(const char *what)
+{
+    printf("%-28s cmds=%lu (17:%lu 18:%lu 24:%lu 25:%lu 12:%lu a23:%lu) rdblk=%lu wrblk=%lu bytes=%lu busy=%lu\n",
+           what, commands(), st_cmd[17], st_cmd[18], st_cmd[24], st_cmd[25], st_cmd[12], st_acmd23,
+           st_rd_blocks, st_wr_blocks, st_bytes, st_busy);
+}
+
+static void reset(void)
+{
+    memset(st_cmd, 0, sizeof st_cmd);
+    st_bytes = 0;
+    st_busy = 0;
+    st_rd_blocks = 0;
+    st_wr_blocks = 0;
+    st_acmd23 = 0;
+}
+
+//counts a failed check
+static void check(int ok)
+{
+    if (!ok)
+        failures++;
+}
+
+//FNV-1a hash of n bytes
+static unsigned long fnv(const uint8_t *p, unsigned long n)
+{
+    unsigned long h = 2166136261u;
+
+    while (n--)
+        h = (h ^ *p++) * 16777619u;
+
+    return h & 0xffffffff;
+}
+
+#include "scenarios.c"
+
+int main(int argc, char **argv)
+{
+    FILE *f;
+    long size;
+    int ok;
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: harness card.img out.img\n");
+        return 1;
+    }
+
+    f = fopen(argv[1], "rb");
+    if (!f)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    img = malloc(size);
+    if (fread(img, 1, size, f) != (size_t)size)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    fclose(f);
+    nblocks = size / 512;
+
+    if (getenv("V"))
+        verbose = 1;
+    if (getenv("MAXKHZ"))
+        emu_max_khz = atoi(getenv("MAXKHZ"));
+    memcpy(csd, getenv("CSD1") ? csd1 : csd2, 16);
+
+    spi_init();
+    if (SD_init())
+    {
+        printf("init failed\n");
+        return 1;
+    }
+    if (getBootSectorData())
+    {
+        printf("boot failed\n");
+        return 1;
+    }
+
+    run();
+    unmountCard();
+
+    if (getenv("DIVIDER"))
+    {
+        ok = (_cardInfo.spiDivider == atoi(getenv("DIVIDER")));
+        printf("clock divider %u expected %s %s\n", _cardInfo.spiDivider, getenv("DIVIDER"), ok ? "OK" : "FAIL");
+        check(ok);
+    }
+
+    f = fopen(argv[2], "wb");
+    fwrite(img, 1, size, f);
+    fclose(f);
+
+    printf("%d failed\n", failures);
+    return failures;
+}
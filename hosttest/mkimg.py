@@ -0,0 +1,90 @@
+# usage: mkimg.py out.img [sectors per cluster] [size in MB]
+# makes the FAT32 card image the scenarios in scenarios.c expect
+import struct, sys
+out=sys.argv[1]; spc=int(sys.argv[2]) if len(sys.argv)>2 else 4
+mb=int(sys.argv[3]) if len(sys.argv)>3 else 32
+part=2048; total=mb*2048; vol=total-part
+res=32; nf=2
+clus=(vol-res)//spc
+fatsz=(clus*4+511)//512+1
+clus=(vol-res-nf*fatsz)//spc
+img=bytearray(total*512)
+mbr=bytearray(512); mbr[446:462]=struct.pack('<BBHBBHII',0,0,0,0x0c,0,0,part,vol); mbr[510:512]=b'\x55\xaa'
+img[0:512]=mbr
+bs=bytearray(512)
+bs[0:3]=b'\xeb\x58\x90'; bs[3:11]=b'MSWIN4.1'
+struct.pack_into('<HBHBHHBHHHII',bs,11,512,spc,res,nf,0,0,0xf8,0,63,255,part,vol)
+struct.pack_into('<IHHIHH',bs,36,fatsz,0,0,2,1,6)
+bs[66]=0x29; bs[71:82]=b'NO NAME    '; bs[82:90]=b'FAT32   '; bs[510:512]=b'\x55\xaa'
+def sec(n): return (part+n)*512
+img[sec(0):sec(0)+512]=bs; img[sec(6):sec(6)+512]=bs
+fat=[0]*(clus+2); fat[0]=0x0ffffff8; fat[1]=0x0fffffff; fat[2]=0x0fffffff
+first_data=res+nf*fatsz
+def cl2sec(c): return first_data+(c-2)*spc
+nextfree=[3]
+def alloc(n, gap=0):
+    cs=[]
+    for i in range(n):
+        c=nextfree[0]; nextfree[0]+=1+ (gap if i%2==1 else 0); cs.append(c)
+    for a,b in zip(cs,cs[1:]): fat[a]=b
+    fat[cs[-1]]=0x0fffffff
+    return cs
+def writedata(cs,data):
+    cb=spc*512
+    for i,c in enumerate(cs):
+        chunk=data[i*cb:(i+1)*cb]; o=sec(cl2sec(c)); img[o:o+len(chunk)]=chunk
+def lfn_entries(name, short):
+    s=0
+    for ch in short: s=(((s&1)<<7)+(s>>1)+ch)&0xff
+    u=[ord(c) for c in name]+[0]
+    while len(u)%13: u.append(0xffff)
+    n=len(u)//13; ents=[]
+    for i in range(n,0,-1):
+        part_=u[(i-1)*13:i*13]; e=bytearray(32)
+        e[0]=i|(0x40 if i==n else 0)
+        for k in range(5): struct.pack_into('<H',e,1+2*k,part_[k])
+        e[11]=0x0f; e[13]=s
+        for k in range(6): struct.pack_into('<H',e,14+2*k,part_[5+k])
+        for k in range(2): struct.pack_into('<H',e,28+2*k,part_[11+k])
+        ents.append(bytes(e))
+    return ents
+def dent(short, attr, c, size):
+    e=bytearray(32); e[0:11]=short; e[11]=attr
+    struct.pack_into('<HHI',e,20,c>>16,0,0); struct.pack_into('<H',e,26,c&0xffff); struct.pack_into('<I',e,28,size)
+    return bytes(e)
+def short83(n):
+    if '.' in n: b,x=n.split('.'); return (b.upper().ljust(8)+x.upper().ljust(3)).encode()
+    return n.upper().ljust(11).encode()
+dirs={2:[]}
+def mkfile(dircl,name,data,gap=0,longname=None):
+    n=max(1,(len(data)+spc*512-1)//(spc*512)); cs=alloc(n,gap); writedata(cs,data)
+    if longname:
+        sh=short83(name); dirs[dircl]+=lfn_entries(longname,sh)
+    dirs[dircl].append(dent(short83(name),0x20,cs[0],len(data)))
+    return cs
+def mkdir(dircl,name):
+    cs=alloc(1); dirs[cs[0]]=[dent(b'.          ',0x10,cs[0],0),dent(b'..         ',0x10,0,0)]
+    dirs[dircl].append(dent(short83(name),0x10,cs[0],0)); return cs[0]
+rnd=bytes((i*7+(i>>9)*13)&0xff for i in range(1<<20))
+mkfile(2,'SMALL.TXT',b'hello world\nline two\nthird line here\n')
+mkfile(2,'BIG.BIN',rnd)
+mkfile(2,'FRAG.BIN',rnd[:200000],gap=1)
+mkfile(2,'LONGFI~1.TXT',b'long name file contents\n',longname='Long Name Example.txt')
+fold=mkdir(2,'FOLDER')
+for i in range(40):
+    mkfile(fold,'F%02d.TXT'%i,(b'file %d\n'%i)*(i+1))
+logs=mkdir(2,'LOGS')
+mkfile(logs,'RUN.BIN',rnd[:5000])
+mkfile(2,'THIRTY~1.TXT',b'thirty two\n',longname='Thirty two characters long 1.txt')
+for dc,ents in dirs.items():
+    data=b''.join(ents)
+    cs=[dc]; 
+    assert len(data)<=spc*512, (dc,len(data))
+    o=sec(cl2sec(dc)); img[o:o+len(data)]=data
+for k in range(nf):
+    o=sec(res+k*fatsz)
+    for i,v in enumerate(fat): struct.pack_into('<I',img,o+4*i,v)
+fs=bytearray(512); struct.pack_into('<I',fs,0,0x41615252); struct.pack_into('<III',fs,484,0x61417272,clus-sum(1 for v in fat[2:] if v),nextfree[0]); struct.pack_into('<I',fs,508,0xaa550000)
+img[sec(1):sec(1)+512]=fs
+open(out,'wb').write(img)
+print("clusters",clus,"fatsz",fatsz,"first_data",first_data)
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Builds the library for the host with AVR sized integers, runs the scenarios
+# against an emulated SD card and checks the card image it leaves behind.
+# usage: hosttest/run.sh [compiler flags, e.g. -DFAT_CACHE=1]
+# needs cc and python3; the build goes to hosttest/build, and stops at a
+# compiler warning
+set -e
+HERE=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$HERE")
+OUT="$HERE/build"
+
+rm -rf "$OUT"
+mkdir -p "$OUT/src"
+
+# int and long are 16 and 32 bits on the AVR
+for f in "$ROOT"/*.c "$ROOT"/*.h; do
+  sed -E 's/\bunsigned long\b/uint32_t/g; s/\bunsigned int\b/uint16_t/g; s/\blong\b/int32_t/g; s/\r$//' \
+    "$f" > "$OUT/src/$(basename "$f")"
+done
+cp "$OUT/src/sd_routines.h" "$OUT/src/SD_routines.h"
+
+# the byte and block transfers go to the emulator in stubs.c
+python3 "$HERE/strip_funcs.py" "$OUT/src/SPI_routines.c" SPI_transmit SPI_receive \
+  SPI_transmitBlock SPI_receiveBlock SPI_receiveToSink SPI_transmitFromSource
+
+CC=${CC:-cc}
+CFLAGS="-I$HERE -I$OUT/src -include stdint.h -fcommon -fpack-struct -funsigned-char -O1 -Wall -Werror $*"
+for f in "$OUT/src/SD_routines.c" "$OUT/src/FAT32.c" "$OUT/src/SPI_routines.c" \
+         "$HERE/sdemu.c" "$HERE/stubs.c" "$HERE/harness.c"; do
+  $CC $CFLAGS -c "$f" -o "$OUT/$(basename "$f" .c).o"
+done
+$CC -o "$OUT/harness" "$OUT"/*.o
+
+python3 "$HERE/mkimg.py" "$OUT/card.img" > /dev/null
+
+# runs the scenarios on one card, name then the harness settings
+status=0
+card() {
+  name=$1
+  shift
+  env "$@" "$OUT/harness" "$OUT/card.img" "$OUT/$name.img" > "$OUT/$name.log" || status=1
+  python3 "$HERE/fsck.py" "$OUT/$name.img" > "$OUT/$name.fsck" || status=1
+  echo "$name: $(tail -1 "$OUT/$name.log"), $(grep -c '^ERROR' "$OUT/$name.fsck") fsck errors"
+}
+
+# the clock follows the CSD, and falls back when the card fails transfers
+card sdhc DIVIDER=2
+card csd1 CSD1=1 DIVIDER=4
+card slow MAXKHZ=1000 DIVIDER=8
+
+[ $status -eq 0 ] && echo "PASS" || echo "FAIL, see the logs in $OUT"
+exit $status
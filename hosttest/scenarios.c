@@ -0,0 +1,994 @@
+/*
+    scenarios.c
+    test scenarios, included by harness.c. The card image comes from
+    mkimg.py: SMALL.TXT, BIG.BIN (1 MB, contiguous), FRAG.BIN (200 KB, a gap
+    after every second cluster), a long name file, FOLDER with F00..F39 and
+    LOGS
+*/
+
+//test pattern of the generated files, byte n of a file
+static uint8_t patternByte(unsigned long n)
+{
+    return (uint8_t)(n * 7 + (n >> 9) * 13);
+}
+
+//hash of the first n bytes of the test pattern
+static unsigned long patternHash(unsigned long n)
+{
+    static uint8_t b[2 << 20];
+    unsigned long i;
+
+    for (i = 0; i < n; i++)
+        b[i] = patternByte(i);
+
+    return fnv(b, n);
+}
+
+//first cluster of a directory in the root directory
+static unsigned long directoryCluster(const char *name)
+{
+    unsigned char b[16];
+
+    strcpy((char *)b, name);
+    return getFirstCluster(findFile(b, _rootCluster));
+}
+
+//reads the rest of the open file into ref with getNextFileBlock, returns
+//the bytes read
+static unsigned long readBlocks(uint8_t *ref)
+{
+    unsigned long n = 0;
+    unsigned int m;
+
+    while (_filePosition.byteCounter < _filePosition.fileSize)
+    {
+        m = getNextFileBlock();
+        memcpy(ref + n, (void *)_buffer, m);
+        n += m;
+    }
+
+    return n;
+}
+
+//reads a file block by block; files of the test pattern are checked
+//against it, short text files only for their size
+static void readall(const char *name, unsigned long dir)
+{
+    static uint8_t out[2 << 20];
+    unsigned char fn[40];
+    unsigned long n;
+    int ok;
+
+    strcpy((char *)fn, name);
+    reset();
+    if (!openFileForReading(fn, dir))
+    {
+        printf("open %s FAIL\n", name);
+        check(0);
+        return;
+    }
+
+    n = readBlocks(out);
+    ok = (n == _filePosition.fileSize && (n < 1000 || fnv(out, n) == patternHash(n)));
+    printf("read %s %lu bytes hash %08lx %s\n", name, n, fnv(out, n), ok ? "OK" : "MISMATCH");
+    stats("  read");
+    check(ok);
+}
+
+//a file read goes out as one CMD18 per contiguous run of clusters
+static void streamtest(const char *name, unsigned long maxCommands)
+{
+    readall(name, _rootCluster);
+    printf("stream %s %lu commands %s\n", name, commands(), commands() <= maxCommands ? "OK" : "FAIL");
+    check(commands() <= maxCommands);
+}
+
+static unsigned long prealloc;  //bytes writefile preallocates, 0 for none
+
+//writes the test pattern through writeBufferToFile
+static void writefile(const char *name, unsigned long dir, unsigned long size)
+{
+    unsigned char fn[40];
+    unsigned long i, n = 0, k, sectors;
+    uint32_t lba = 0;
+
+    strcpy((char *)fn, name);
+    reset();
+    openFileForWriting(fn, dir);
+    if (prealloc)
+    {
+        sectors = preallocateFile(prealloc, &lba);
+        printf("prealloc %lu -> %lu sectors at %lu\n", prealloc, sectors, (unsigned long)lba);
+    }
+    printf("start=%lu nextfree=%lu\n", (unsigned long)_filePosition.startCluster,
+           (unsigned long)getSetFreeCluster(NEXT_FREE, GET, 0));
+
+    while (n < size)
+    {
+        k = (size - n > 512) ? 512 : size - n;
+        for (i = 0; i < 512; i++)
+            _buffer[i] = patternByte(n + i);
+        writeBufferToFile(k);
+        n += k;
+    }
+    closeFile();
+    stats("  write");
+}
+
+//clusters marked free in the FAT
+static unsigned long freeClusters(void)
+{
+    unsigned long cluster, n = 0;
+
+    flushFATCache();
+    for (cluster = 2; cluster < _totalClusters + 2; cluster++)
+        if (getSetNextCluster(cluster, GET, 0) == 0)
+            n++;
+
+    return n;
+}
+
+//files that end with a full cluster take no cluster past it, written
+//sector by sector, preallocated, and through writeFileBytes with a
+//syncFile at the cluster boundary
+static void boundarytest(void)
+{
+    static uint8_t b[4096];
+    unsigned char fn[] = "EDGE3.BIN";
+    unsigned long cluster = (unsigned long)_sectorPerCluster * 512;
+    unsigned long before, i;
+    int ok;
+
+    before = freeClusters();
+    writefile("EDGE1.BIN", _rootCluster, 2 * cluster);
+    ok = (before - freeClusters() == 2);
+
+    before = freeClusters();
+    prealloc = 4 * cluster;
+    writefile("EDGE2.BIN", _rootCluster, 2 * cluster);
+    prealloc = 0;
+    ok = ok && (before - freeClusters() == 2);
+
+    before = freeClusters();
+    openFileForWriting(fn, _rootCluster);
+    for (i = 0; i < cluster; i++)
+        b[i] = patternByte(i);
+    writeFileBytes(b, cluster);
+    syncFile();
+    for (i = 0; i < cluster; i++)
+        b[i] = patternByte(cluster + i);
+    writeFileBytes(b, cluster);
+    closeFile();
+    ok = ok && (before - freeClusters() == 2);
+
+    printf("boundary files take 2 clusters each %s\n", ok ? "OK" : "FAIL");
+    check(ok);
+    readall("EDGE1.BIN", _rootCluster);
+    readall("EDGE2.BIN", _rootCluster);
+    readall("EDGE3.BIN", _rootCluster);
+}
+
+//seeks around a file and reads on from there
+static void seektest(const char *name, unsigned long dir)
+{
+    static uint8_t ref[2 << 20];
+    static const unsigned long offsets[] = {0, 1000, 512, 2048, 2047, 4096 * 3, 199999, 100000,
+                                            8192, 8191, 65536, 150000, 512 * 7 + 3, 196608};
+    unsigned char fn[40];
+    unsigned long size, o, at;
+    unsigned int k, i, m, b;
+    int bad = 0;
+
+    strcpy((char *)fn, name);
+    openFileForReading(fn, dir);
+    size = readBlocks(ref);
+    reset();
+
+    for (k = 0; k < sizeof offsets / sizeof offsets[0]; k++)
+    {
+        o = offsets[k];
+        if (o >= size)
+            continue;
+
+        if (seekFile(o))
+        {
+            printf("seek %lu failed\n", o);
+            bad++;
+            continue;
+        }
+
+        m = getNextFileBlock();
+        b = _filePosition.byte;
+        if (memcmp((void *)(_buffer + b), ref + o, m > b ? m - b : 0))
+        {
+            printf("seek %lu mismatch\n", o);
+            bad++;
+        }
+
+        // two more blocks in sequence
+        for (i = 0; i < 2 && _filePosition.byteCounter < size; i++)
+        {
+            at = _filePosition.byteCounter;
+            m = getNextFileBlock();
+            if (memcmp((void *)_buffer, ref + at, m))
+            {
+                printf("seq after seek %lu mismatch at %lu\n", o, at);
+                bad++;
+            }
+        }
+    }
+    printf("seektest %s %s\n", name, bad ? "FAIL" : "OK");
+    check(!bad);
+    stats("  seek");
+
+    // seeks within the sector in _buffer don't read it again
+    reset();
+    seekFile(1000);
+    getNextFileBlock();
+    seekFile(1000);
+    getNextFileBlock();
+    seekFile(700);
+    getNextFileBlock();
+    stats("  seek same sector");
+}
+
+//the buffered reader, with _buffer used for something else in between
+static void buftest(const char *name, unsigned long dir)
+{
+    static uint8_t ref[2 << 20], got[2 << 20];
+    unsigned char fn[40];
+    unsigned long n, size;
+    unsigned int k, chunk = 1;
+    int bad = 0, c;
+
+    strcpy((char *)fn, name);
+    openFileForReading(fn, dir);
+    size = readBlocks(ref);
+    reset();
+
+    openFileForReading(fn, dir);
+    n = 0;
+    while ((k = readFileBytes(got + n, chunk)) > 0)
+    {
+        n += k;
+        chunk = chunk * 3 % 1000 + 1;
+        if (n % 7 == 3)
+            SD_readSingleBlock(0);
+    }
+    if (n != size || memcmp(got, ref, size))
+    {
+        printf("buf readbytes mismatch n=%lu\n", n);
+        bad++;
+    }
+    stats("  readbytes");
+
+    openFileForReading(fn, dir);
+    n = 0;
+    while ((c = readFileChar()) != FILE_END)
+        got[n++] = c;
+    if (n != size || memcmp(got, ref, size))
+    {
+        printf("buf getc mismatch\n");
+        bad++;
+    }
+
+    openFileForReading(fn, dir);
+    n = 0;
+    while ((k = readFileLine(got + n, 200, 0x41)) > 0)
+        n += k;
+    if (n != size || memcmp(got, ref, size))
+    {
+        printf("buf line mismatch\n");
+        bad++;
+    }
+
+    openFileForReading(fn, dir);
+    seekFile(size / 2 + 5);
+    k = readFileBytes(got, 1500);
+    if (memcmp(got, ref + size / 2 + 5, k))
+    {
+        printf("seek+read mismatch\n");
+        bad++;
+    }
+
+    printf("buftest %s %s\n", name, bad ? "FAIL" : "OK");
+    check(!bad);
+}
+
+//records written with writeFileBytes and writeFileChar, synced twice.
+//tickFSInfo is called all along; it writes FSinfo back through _buffer
+//only after a sync, and the partial sector is read back for the next record
+static void logtest(void)
+{
+    static uint8_t ref[300000], got[300000];
+    unsigned char fn[] = "LOG.TXT", rec[64];
+    unsigned long n = 0;
+    unsigned int i, k, t;
+    int r, bad = 0;
+
+    reset();
+    openFileForWriting(fn, _rootCluster);
+    for (r = 0; r < 3000; r++)
+    {
+        k = sprintf((char *)rec, "rec %d value %d\n", r, r * 37 % 1000);
+        memcpy(ref + n, rec, k);
+        n += k;
+
+        if (r % 3)
+            writeFileBytes(rec, k);
+        else
+            for (i = 0; i < k; i++)
+                writeFileChar(rec[i]);
+
+        tickFSInfo();
+
+        if (r == 1000 || r == 2222)
+        {
+            syncFile();
+            freeMemoryUpdate(REMOVE, 0);    //leaves FSinfo changed
+            for (t = 0; t <= FSINFO_SYNC_TICKS; t++)
+                tickFSInfo();
+            if (_fsInfoDirty)
+            {
+                printf("log FSinfo not written after sync\n");
+                bad++;
+            }
+        }
+    }
+    closeFile();
+    stats("  log write");
+
+    openFileForReading(fn, _rootCluster);
+    if (_filePosition.fileSize != n)
+    {
+        printf("log size %lu != %lu\n", (unsigned long)_filePosition.fileSize, n);
+        bad++;
+    }
+    k = readFileBytes(got, 60000);
+    if (k != n || memcmp(got, ref, n))
+    {
+        printf("log data mismatch\n");
+        bad++;
+    }
+    printf("logtest %lu bytes %s\n", n, bad ? "FAIL" : "OK");
+    check(!bad);
+}
+
+//a file written, then appended to twice
+static void appendtest(const char *name, unsigned long size0, unsigned long add1, unsigned long add2)
+{
+    static uint8_t buf[400000], got[400000];
+    unsigned char fn[40];
+    unsigned long i, n, k = 0;
+    unsigned int m;
+    int bad = 0;
+
+    strcpy((char *)fn, name);
+    for (i = 0; i < sizeof buf; i++)
+        buf[i] = patternByte(i);
+
+    openFileForWriting(fn, _rootCluster);
+    writeFileBytes(buf, size0);
+    closeFile();
+    n = size0;
+
+    reset();
+    if (!openFileForAppending(fn, _rootCluster))
+    {
+        printf("append open failed\n");
+        bad++;
+    }
+    writeFileBytes(buf + n, add1);
+    closeFile();
+    n += add1;
+    stats("  append1");
+
+    reset();
+    if (!openFileForAppending(fn, _rootCluster))
+    {
+        printf("append open failed\n");
+        bad++;
+    }
+    for (i = 0; i < add2; i++)
+        writeFileChar(buf[n + i]);
+    closeFile();
+    n += add2;
+    stats("  append2");
+
+    openFileForReading(fn, _rootCluster);
+    if (_filePosition.fileSize != n)
+    {
+        printf("size %lu != %lu\n", (unsigned long)_filePosition.fileSize, n);
+        bad++;
+    }
+    while ((m = readFileBytes(got + k, 30000)) > 0)
+        k += m;
+    if (k != n || memcmp(got, buf, n))
+    {
+        printf("append data mismatch k=%lu\n", k);
+        bad++;
+    }
+    printf("appendtest %s %lu+%lu+%lu %s\n", name, size0, add1, add2, bad ? "FAIL" : "OK");
+    check(!bad);
+}
+
+//prints whether findFile finds a name, and what it cost
+static struct dir_Structure *find(const char *name, unsigned long dir)
+{
+    unsigned char b[40];
+    struct dir_Structure *d;
+
+    strcpy((char *)b, name);
+    reset();
+    d = findFile(b, dir);
+    printf("find %s %s ", name, d ? "found" : "missing");
+    stats("");
+
+    return d;
+}
+
+//directory listing and lookups, repeated ones come from the name index
+static void dirtest(void)
+{
+    static const char *names[] = {"F39.TXT", "F00.TXT", "F20.TXT", "NOPE.TXT", "F39.TXT", "F05.TXT"};
+    struct dir_Structure *d;
+    unsigned long fold;
+    unsigned int i;
+    int n = 0;
+
+    fold = directoryCluster("FOLDER");
+
+    reset();
+    openDirectory(fold);
+    while ((d = getNextDirectoryEntry()))
+        n++;
+    printf("dir entries %d\n", n);
+    stats("  listdir");
+
+    check(find("F39.TXT", fold) != 0);
+    readall("F39.TXT", fold);
+
+    for (i = 0; i < sizeof names / sizeof names[0]; i++)
+    {
+        d = find(names[i], fold);
+        if (d && strncmp((char *)d->name, names[i], 3))
+        {
+            printf("find %s WRONG\n", names[i]);
+            check(0);
+        }
+    }
+
+    check(find("Long Name Example.txt", _rootCluster) != 0);
+    check(find("Long Name Example.txt", _rootCluster) != 0);
+    check(find("SMALL.TXT", _rootCluster) != 0);
+
+    // a name longer than the part of it kept in RAM
+    check(find("Thirty two characters long 1.txt", _rootCluster) != 0);
+    check(find("Thirty two characters long 1.txt", _rootCluster) != 0);
+#if NAME_INDEX_SIZE
+    printf("long name from the index %s\n", st_rd_blocks <= 1 ? "OK" : "FAIL");
+    check(st_rd_blocks <= 1);
+#endif
+}
+
+//opens a path, returns 1 if it gave the expected result
+static int openPath(const char *path, int expected)
+{
+    unsigned char b[40];
+    int r;
+
+    strcpy((char *)b, path);
+    reset();
+    r = openPathForReading(b);
+    printf("path %s %d %s ", path, r, r == expected ? "OK" : "FAIL");
+    stats("");
+
+    return r == expected;
+}
+
+//path lookups; the path passed in is left as it was
+static void pathtest(void)
+{
+    unsigned char b[40];
+    int r;
+
+    check(openPath("/FOLDER/F39.TXT", 1));
+    check(openPath("/FOLDER/F39.TXT", 1));
+    check(openPath("FOLDER/../FOLDER/F05.TXT", 1));
+    check(openPath("/FOLDER/NOPE.TXT", 0));
+    check(openPath("/NODIR/F00.TXT", 0));
+    check(openPath("/SMALL.TXT/X", 0));
+    check(openPath("/FOLDER/F20.TXT", 1));
+
+    strcpy((char *)b, "/LOGS/path new.log");
+    if (!openPathForWriting(b))
+    {
+        printf("pathw FAIL\n");
+        check(0);
+    }
+    writeFileBytes((unsigned char *)"hello", 5);
+    closeFile();
+
+    strcpy((char *)b, "/folder/Long Name Example.txt");
+    r = openPathForReading(b);
+    r = !r && strcmp((char *)b, "/folder/Long Name Example.txt") == 0;
+    printf("path kept %s\n", r ? "OK" : "FAIL");
+    check(r);
+
+    strcpy((char *)b, "/Long Name Example.txt");
+    r = openPathForReading(b);
+    r = r && strcmp((char *)b, "/Long Name Example.txt") == 0;
+    printf("path case kept %s\n", r ? "OK" : "FAIL");
+    check(r);
+
+    check(openPath("/folder/F39.TXT", 1));
+
+    r = openPath("/LOGS/path new.log", 1) && _filePosition.fileSize == 5;
+    printf("path written size %lu %s\n", (unsigned long)_filePosition.fileSize, r ? "OK" : "FAIL");
+    check(r);
+}
+
+//creates a file holding its own name
+static void createFile(const char *name, unsigned long dir, const char *what)
+{
+    unsigned char b[40];
+
+    strcpy((char *)b, name);
+    openFileForWriting(b, dir);
+    writeFileBytes(b, strlen(name));
+    reset();
+    closeFile();
+    if (what)
+    {
+        printf("create %s ", what);
+        stats("");
+    }
+}
+
+//1 if a file can be opened and has the given size
+static int fileHasSize(const char *name, unsigned long dir, unsigned long size)
+{
+    unsigned char b[40];
+
+    strcpy((char *)b, name);
+    return openFileForReading(b, dir) && _filePosition.fileSize == size;
+}
+
+//counts the entries getNextDirectoryEntry returns
+static int countEntries(unsigned long dir)
+{
+    int n = 0;
+
+    openDirectory(dir);
+    while (getNextDirectoryEntry())
+        n++;
+
+    return n;
+}
+
+//file creation with short and long names, and in slots freed by deletes
+static void createtest(void)
+{
+    unsigned char b[40];
+    struct dir_Structure *d;
+    unsigned long logs;
+    int i, m0, m1, ok;
+
+    logs = directoryCluster("LOGS");
+
+    for (i = 0; i < 60; i++)
+    {
+        sprintf((char *)b, i % 3 ? "C%02d.TXT" : "Created long name %02d.txt", i);
+        sprintf((char *)b + 30, "%d", i);
+        createFile((char *)b, logs, (i == 5 || i == 58) ? (char *)b + 30 : 0);
+    }
+
+    strcpy((char *)b, "C59.TXT");
+    d = findFile(b, logs);
+    if (d)
+        deleteFile();
+    else
+    {
+        printf("C59 missing FAIL\n");
+        check(0);
+    }
+    createFile("AFTERDEL.TXT", logs, "afterdel");
+
+    // deletes in the middle of the directory, the free slots get reused
+    m0 = countEntries(logs);
+    strcpy((char *)b, "C20.TXT");
+    if (findFile(b, logs))
+        deleteFile();
+    strcpy((char *)b, "C10.TXT");
+    if (findFile(b, logs))
+        deleteFile();
+    for (i = 11; i < 58; i++)
+    {
+        if (i % 3 == 0 || i == 20)
+            continue;
+        sprintf((char *)b, "C%02d.TXT", i);
+        if (!openFileForReading(b, logs))
+        {
+            printf("after middle delete %s FAIL\n", b);
+            check(0);
+        }
+    }
+
+    createFile("MIDDEL1.TXT", logs, "middle1");
+    createFile("MIDDEL2.TXT", logs, "middle2");
+    createFile("ATEND.TXT", logs, "atend");
+    m1 = countEntries(logs);
+
+    for (i = 11; i < 58; i++)
+    {
+        if (i % 3 == 0 || i == 20)
+            continue;
+        sprintf((char *)b, "C%02d.TXT", i);
+        if (!openFileForReading(b, logs))
+        {
+            printf("after middle create %s FAIL\n", b);
+            check(0);
+        }
+    }
+    ok = fileHasSize("MIDDEL1.TXT", logs, 11) && fileHasSize("MIDDEL2.TXT", logs, 11)
+         && fileHasSize("ATEND.TXT", logs, 9) && m1 == m0 + 1;
+    printf("middle delete %d->%d %s\n", m0, m1, ok ? "OK" : "FAIL");
+    check(ok);
+
+    printf("logs entries %d\n", countEntries(logs));
+
+    for (i = 0; i < 10; i++)
+    {
+        sprintf((char *)b, i % 3 ? "C%02d.TXT" : "Created long name %02d.txt", i);
+        if (!fileHasSize((char *)b, logs, strlen((char *)b)))
+        {
+            printf("created %s FAIL\n", b);
+            check(0);
+        }
+    }
+
+    ok = fileHasSize("AFTERDEL.TXT", logs, 12);
+    printf("afterdel %s\n", ok ? "OK" : "FAIL");
+    check(ok);
+}
+
+//a long name written over deleted short name entries
+static void reusetest(void)
+{
+    unsigned long fold;
+    int i, ok;
+
+    fold = directoryCluster("FOLDER");
+
+    // F10..F13 deleted behind the library's back
+    for (i = 12; i < 16; i++)
+        img[(size_t)getFirstSector(fold) * 512 + i * 32] = 0xe5;
+    _bufferBlock = NO_BLOCK;
+
+    createFile("Reused slot name.txt", fold, "reuse");
+    printf("folder entries %d\n", countEntries(fold));
+
+    ok = fileHasSize("Reused slot name.txt", fold, 20);
+    printf("reuse %s\n", ok ? "OK" : "FAIL");
+    check(ok);
+
+    createFile("Another reused name.txt", fold, "long");
+}
+
+//~1 to ~99 aliases all in use, the next create fails without leaking.
+//With the tails of the alias known, a long name create reads no more of
+//the directory than a short one
+static void aliastest(void)
+{
+    unsigned char b[40];
+    struct dir_Structure *d;
+    unsigned long logs, before = 0, reads = 0;
+    int i, ok;
+
+    logs = directoryCluster("LOGS");
+
+    for (i = 0; i < 100; i++)
+    {
+        sprintf((char *)b, "Alias exhaust %03d.txt", i);
+        openFileForWriting(b, logs);
+        if (i == 99)
+            before = _freeClusterCount;
+        writeFileBytes(b, strlen((char *)b));
+        reset();
+        closeFile();
+        if (i == 98)
+            reads = st_rd_blocks;
+    }
+    printf("alias98 create %lu blocks read %s\n", reads, reads <= 2 ? "OK" : "FAIL");
+    check(reads <= 2);
+
+    strcpy((char *)b, "Alias exhaust 098.txt");
+    i = openFileForReading(b, logs);
+    strcpy((char *)b, "ALIAS~99.PRG");
+    d = findFile(b, logs);
+    ok = i && d;
+    printf("alias99 %s\n", ok ? "OK" : "FAIL");
+    check(ok);
+
+    strcpy((char *)b, "Alias exhaust 099.txt");
+    i = openFileForReading(b, logs);
+    ok = !i && _freeClusterCount == before;
+    printf("alias exhausted %s\n", ok ? "OK" : "FAIL");
+    check(ok);
+
+    // a short name that looks like an alias takes its tail
+    createFile("Shadowed name one.txt", logs, 0);
+    createFile("SHADOW~2.PRG", logs, 0);
+    createFile("Shadowed name two.txt", logs, 0);
+    strcpy((char *)b, "SHADOW~3.PRG");
+    d = findFile(b, logs);
+    ok = d && (d->fileSize == 21) && fileHasSize("SHADOW~2.PRG", logs, 12)
+         && fileHasSize("Shadowed name two.txt", logs, 21);
+    printf("alias after short name %s\n", ok ? "OK" : "FAIL");
+    check(ok);
+}
+
+//queued writes and a read behind them
+static void asynctest(void)
+{
+    static unsigned char a[512], b[512], c[512];
+    unsigned long block = nblocks - 10;
+    unsigned char h1, h2, h3;
+    int i, polls = 0, ok;
+
+    reset();
+    for (i = 0; i < 512; i++)
+    {
+        a[i] = i * 3;
+        b[i] = i * 5 + 1;
+    }
+
+    h1 = SD_submitWrite(block, a);
+    printf("async: after submit write state=%d (expect %d)\n", SD_requestState(h1), SD_REQ_PROGRAMMING);
+    h2 = SD_submitWrite(block + 1, b);
+    printf("async: second write state=%d (expect pending %d)\n", SD_requestState(h2), SD_REQ_PENDING);
+    h3 = SD_submitRead(block, c);
+    while (SD_poll())
+        polls++;
+
+    ok = SD_requestState(h1) == SD_REQ_DONE && SD_requestState(h2) == SD_REQ_DONE
+         && SD_requestState(h3) == SD_REQ_DONE
+         && memcmp(a, c, 512) == 0 && memcmp(b, img + (size_t)(block + 1) * 512, 512) == 0;
+    printf("async: polls=%d states %d %d %d %s\n", polls, SD_requestState(h1), SD_requestState(h2),
+           SD_requestState(h3), ok ? "OK" : "MISMATCH");
+    check(ok);
+    stats("  async");
+}
+
+static uint8_t *sinkPointer;
+static unsigned long sourceCount;
+
+static void testSink(unsigned char c)
+{
+    *sinkPointer++ = c;
+}
+
+static unsigned char testSource(void)
+{
+    return patternByte(sourceCount++);
+}
+
+//a file written from a byte source and read into a byte sink
+static void sinktest(const char *name, unsigned long size)
+{
+    static uint8_t out[2 << 20];
+    unsigned char fn[40];
+    unsigned long n = 0, k;
+    int ok;
+
+    strcpy((char *)fn, name);
+    reset();
+    openFileForWriting(fn, _rootCluster);
+    sourceCount = 0;
+    while (n < size)
+    {
+        k = (size - n > 512) ? 512 : size - n;
+        writeSourceToFile(testSource, k);
+        n += k;
+    }
+    closeFile();
+    stats("  srcwrite");
+
+    reset();
+    openFileForReading(fn, _rootCluster);
+    sinkPointer = out;
+    while (_filePosition.byteCounter < _filePosition.fileSize)
+        getNextFileBlockToSink(testSink);
+    n = sinkPointer - out;
+    ok = (n == size && fnv(out, n) == patternHash(n));
+    printf("sink %s %lu %s\n", name, n, ok ? "OK" : "MISMATCH");
+    stats("  sinkread");
+    check(ok);
+}
+
+//SD_readWindow reads part of a block without touching _buffer
+static void windowtest(void)
+{
+    unsigned char w[40];
+    unsigned long block = _unusedSectors + 1, keep;
+    int ok;
+
+    SD_readSingleBlock(0);
+    keep = _bufferBlock;
+    reset();
+
+    ok = !SD_readWindow(block, 484, 28, w) && !memcmp(w, img + block * 512 + 484, 28) && _bufferBlock == keep;
+    printf("window %s\n", ok ? "OK" : "FAIL");
+    check(ok);
+
+    ok = !SD_readWindow(block, 0, 4, w) && !memcmp(w, img + block * 512, 4)
+         && !SD_readWindow(block, 508, 4, w) && !memcmp(w, img + block * 512 + 508, 4);
+    if (!ok)
+        printf("window edge FAIL\n");
+    check(ok);
+    stats("  window");
+}
+
+//FILL=n marks clusters 2 to n used before writing, for the free search
+static void filltest(unsigned long fill)
+{
+    uint32_t *fat = (uint32_t *)(img + (size_t)(_unusedSectors + _reservedSectorCount) * 512);
+    unsigned long c;
+
+    for (c = 2; c < fill; c++)
+        if (!fat[c])
+            fat[c] = 0x0fffffff;
+
+    reset();
+    printf("search %lu\n", (unsigned long)searchNextFreeCluster(2));
+    stats("  search1");
+    reset();
+    printf("search %lu\n", (unsigned long)searchNextFreeCluster(2));
+    stats("  search2");
+
+    writefile("FILL1.BIN", _rootCluster, 5000);
+    writefile("FILL2.BIN", _rootCluster, 5000);
+    writefile("FILL3.BIN", _rootCluster, 5000);
+    readall("FILL3.BIN", _rootCluster);
+}
+
+//cuts the chain of a file after its first cluster and reads it; the read
+//stops there instead of going on past the extents that were mapped
+static void chaintest(void)
+{
+    static uint8_t out[2 << 20];
+    unsigned char fn[] = "CHAIN.BIN";
+    unsigned long first, next, n, expected;
+    int ok;
+
+    writefile("CHAIN.BIN", _rootCluster, 20000);
+    openFileForReading(fn, _rootCluster);
+    first = _filePosition.startCluster;
+    next = getSetNextCluster(first, GET, 0);
+    getSetNextCluster(first, SET, EOF);
+    flushFATCache();
+
+    reset();
+    openFileForReading(fn, _rootCluster);
+    expected = (unsigned long)_sectorPerCluster * 512;
+    n = readBlocks(out);
+    ok = (n == expected && fnv(out, n) == patternHash(n));
+    openFileForReading(fn, _rootCluster);
+    ok = ok && readFileBytes(out, 30000) == expected;
+    printf("chain cut read %lu of %lu bytes %s\n", n, expected, ok ? "OK" : "FAIL");
+    check(ok);
+
+    getSetNextCluster(first, SET, next);
+    flushFATCache();
+}
+
+//appends to a file until the card is full; the last scenario, the space
+//stays used. The file has its entry first, a new one may need a directory
+//cluster the full card doesn't have
+static void fulltest(void)
+{
+    static uint8_t chunk[4096];
+    unsigned char fn[] = "FULL.BIN";
+    unsigned long n = 0, size, i;
+    unsigned int k;
+    int full = 0, bad = 0;
+
+    openFileForWriting(fn, _rootCluster);
+    closeFile();
+
+    reset();
+    openFileForAppending(fn, _rootCluster);
+    while (!full && n < (unsigned long)nblocks * 512)
+    {
+        for (i = 0; i < sizeof chunk; i++)
+            chunk[i] = patternByte(n + i);
+        full = writeFileBytes(chunk, sizeof chunk);
+        n += sizeof chunk;
+    }
+    if (!full)
+    {
+        printf("full: no error after %lu bytes\n", n);
+        bad++;
+    }
+    closeFile();
+    stats("  fill card");
+
+    // what was taken is in the file, in order
+    if (!openFileForReading(fn, _rootCluster))
+    {
+        printf("full: file missing\n");
+        bad++;
+    }
+    size = _filePosition.fileSize;
+    n = 0;
+    while ((k = readFileBytes(chunk, sizeof chunk)) > 0)
+    {
+        for (i = 0; i < k; i++)
+            if (chunk[i] != patternByte(n + i))
+                bad++;
+        n += k;
+    }
+    if (n != size || size == 0)
+    {
+        printf("full: read %lu of %lu bytes\n", n, size);
+        bad++;
+    }
+
+    printf("fulltest %lu bytes %s\n", size, bad ? "FAIL" : "OK");
+    check(!bad);
+}
+
+static void run(void)
+{
+    windowtest();
+    asynctest();
+
+    printf("clock divider %u maxkhz %lu blocks %lu csdv %u\n", _cardInfo.spiDivider,
+           (unsigned long)_cardInfo.maxClockKHz, (unsigned long)_cardInfo.totalBlocks, _cardInfo.csdVersion);
+    printf("geom spc=%u bps=%u res=%u root=%lu fds=%lu tot=%lu unused=%lu\n", _sectorPerCluster,
+           _bytesPerSector, _reservedSectorCount, (unsigned long)_rootCluster,
+           (unsigned long)_firstDataSector, (unsigned long)_totalClusters, (unsigned long)_unusedSectors);
+
+    if (getenv("FILL"))
+        filltest(atol(getenv("FILL")));
+
+    dirtest();
+    pathtest();
+    createtest();
+    reusetest();
+    aliastest();
+
+    readall("SMALL.TXT", _rootCluster);
+    streamtest("BIG.BIN", 16);      //one CMD18 for the whole file instead of 2048 reads
+    streamtest("FRAG.BIN", 160);    //one CMD18 and CMD12 for each of the 50 runs
+    readall("Long Name Example.txt", _rootCluster);
+    seektest("FRAG.BIN", _rootCluster);
+    seektest("BIG.BIN", _rootCluster);
+    buftest("FRAG.BIN", _rootCluster);
+    buftest("SMALL.TXT", _rootCluster);
+
+    writefile("OUT.BIN", _rootCluster, 300000);
+    writefile("Another long name.dat", _rootCluster, 1000);
+    readall("OUT.BIN", _rootCluster);
+    prealloc = 300000;
+    writefile("PRE1.BIN", _rootCluster, 300000);
+    readall("PRE1.BIN", _rootCluster);
+    prealloc = 500000;
+    writefile("PRE2.BIN", _rootCluster, 100000);
+    readall("PRE2.BIN", _rootCluster);
+    prealloc = 20000;
+    writefile("PRE3.BIN", _rootCluster, 60000);
+    readall("PRE3.BIN", _rootCluster);
+    prealloc = 0;
+
+    logtest();
+    sinktest("SINK.BIN", 70000);
+    readall("SINK.BIN", _rootCluster);
+    appendtest("APP1.BIN", 1000, 300, 5000);
+    appendtest("APP2.BIN", 8192, 2048, 100);
+    appendtest("APP3.BIN", 0, 0, 700);
+    appendtest("Appended long name.log", 4096 * 3 + 17, 60000, 2);
+    boundarytest();
+    chaintest();
+    fulltest();
+}
@@ -0,0 +1,272 @@
+/*
+    sdemu.c
+    host SD card emulator speaking the SPI mode SD protocol, one byte per
+    emu_xfer call. The card image is held in img; the AVR registers the
+    library touches are plain variables here
+*/
+#include <ctype.h>
+#include <stdio.h>
+#include "avr/io.h"
+
+volatile unsigned char PORTB = 0xff, DDRB, PORTD, DDRD, SPCR, SPSR, SPDR, MCUCR;
+volatile unsigned char UCSR0A = 0xff, UCSR0B, UCSR0C, UDR0, UBRR0H, UBRR0L;
+volatile uint16_t UBRR0;
+
+uint8_t *img;           //card image
+uint32_t nblocks;       //its size in blocks
+int emu_sdhc = 1;       //block addressing
+int verbose = 0;
+uint8_t csd[16];
+
+//statistics, cleared by reset() in harness.c
+unsigned long st_cmd[64], st_bytes, st_busy, st_rd_blocks, st_wr_blocks, st_acmd23;
+
+extern int emu_clock_ok(void);
+
+//card modes between commands
+#define M_IDLE      0
+#define M_RMULTI    1   //multiple block read, the next block is sent when the FIFO runs dry
+#define M_WSINGLE   2   //waiting for the data token of a single block write
+#define M_WMULTI    3   //waiting for the data token of a multiple block write
+#define M_WDATA     4   //taking in a data block
+
+//bytes the card sends next
+static uint8_t fifo[2048];
+static int fifoHead, fifoTail;
+
+static uint8_t cmdbuf[6];
+static int cmdIndex;
+static int appCmd, acmd41Tries;
+static int mode, writeMulti, writeCount, busy;
+static uint32_t curBlock;
+static uint8_t writeBuf[514];
+
+//avr-libc has it, glibc doesn't
+char *strupr(char *s)
+{
+    char *p;
+
+    for (p = s; *p; p++)
+        *p = toupper((unsigned char)*p);
+
+    return s;
+}
+
+static void queue(uint8_t b)
+{
+    fifo[fifoTail++ & 2047] = b;
+}
+
+static int queueEmpty(void)
+{
+    return fifoHead == fifoTail;
+}
+
+static uint8_t dequeue(void)
+{
+    return fifo[fifoHead++ & 2047];
+}
+
+//queues a data block with its start token and CRC
+static void queueBlock(uint32_t block)
+{
+    int i;
+
+    queue(0xff);
+    queue(0xff);
+    queue(0xfe);
+    for (i = 0; i < 512; i++)
+        queue(block < nblocks ? img[(size_t)block * 512 + i] : 0);
+    queue(0x12);
+    queue(0x34);
+
+    st_rd_blocks++;
+}
+
+//block number of a command argument
+static uint32_t blockAddress(uint32_t arg)
+{
+    return emu_sdhc ? arg : arg >> 9;
+}
+
+static void doCommand(void)
+{
+    int cmd = cmdbuf[0] & 0x3f;
+    uint32_t arg = ((uint32_t)cmdbuf[1] << 24) | (cmdbuf[2] << 16) | (cmdbuf[3] << 8) | cmdbuf[4];
+    int wasApp = appCmd;
+    int i;
+
+    appCmd = 0;
+    st_cmd[cmd]++;
+    if (verbose)
+        fprintf(stderr, "CMD%d%s %08x\n", cmd, wasApp ? "(A)" : "", arg);
+
+    if (cmd == 12)
+    {
+        // a stuff byte, the response, then busy
+        mode = M_IDLE;
+        fifoHead = fifoTail = 0;
+        queue(0xaa);
+        queue(0x00);
+        busy = 3;
+        return;
+    }
+
+    fifoHead = fifoTail = 0;
+    queue(0xff);
+
+    switch (cmd)
+    {
+    case 0:
+        queue(0x01);
+        break;
+    case 8:
+        queue(0x01);
+        queue(0);
+        queue(0);
+        queue(1);
+        queue(0xaa);
+        break;
+    case 55:
+        appCmd = 1;
+        queue(0x01);
+        break;
+    case 41:
+        queue(acmd41Tries++ < 2 ? 0x01 : 0x00);
+        break;
+    case 58:
+        queue(0x00);
+        queue(emu_sdhc ? 0xc0 : 0x80);
+        queue(0xff);
+        queue(0x80);
+        queue(0);
+        break;
+    case 9:
+        queue(0x00);
+        queue(0xff);
+        queue(0xfe);
+        for (i = 0; i < 16; i++)
+            queue(csd[i]);
+        queue(0);
+        queue(0);
+        break;
+    case 13:
+        queue(0x00);
+        queue(0x00);
+        break;
+    case 16:
+    case 59:
+        queue(0x00);
+        break;
+    case 23:
+        if (wasApp)
+            st_acmd23++;
+        queue(0x00);
+        break;
+    case 17:
+        queue(0x00);
+        if (emu_clock_ok())
+            queueBlock(blockAddress(arg));
+        break;
+    case 18:
+        queue(0x00);
+        curBlock = blockAddress(arg);
+        mode = M_RMULTI;
+        break;
+    case 24:
+        queue(0x00);
+        curBlock = blockAddress(arg);
+        mode = M_WSINGLE;
+        writeMulti = 0;
+        break;
+    case 25:
+        queue(0x00);
+        curBlock = blockAddress(arg);
+        mode = M_WMULTI;
+        writeMulti = 1;
+        break;
+    default:
+        queue(0x04);    //illegal command
+        break;
+    }
+}
+
+//takes in one byte of a data block; a block sent above the clock the
+//card keeps up with is rejected
+static void takeData(uint8_t mosi)
+{
+    writeBuf[writeCount++] = mosi;
+    if (writeCount < 514)
+        return;
+
+    mode = writeMulti ? M_WMULTI : M_IDLE;
+    if (!emu_clock_ok())
+    {
+        queue(0xeb);    //write error
+        return;
+    }
+
+    if (curBlock < nblocks)
+        memcpy(img + (size_t)curBlock * 512, writeBuf, 512);
+    st_wr_blocks++;
+    curBlock++;
+    queue(0xe5);        //data accepted
+    busy = 20;
+}
+
+//one byte each way on the SPI bus
+uint8_t emu_xfer(uint8_t mosi)
+{
+    st_bytes++;
+
+    if (PORTB & 0x04)   //not selected
+        return 0xff;
+
+    if (mode == M_WDATA)
+    {
+        takeData(mosi);
+        return 0xff;
+    }
+
+    if (busy > 0 && queueEmpty())
+    {
+        busy--;
+        st_busy++;
+        return 0x00;
+    }
+
+    if ((mode == M_WSINGLE || mode == M_WMULTI) && cmdIndex == 0)
+    {
+        if ((mode == M_WSINGLE && mosi == 0xfe) || (mode == M_WMULTI && mosi == 0xfc))
+        {
+            mode = M_WDATA;
+            writeCount = 0;
+            return 0xff;
+        }
+        if (mode == M_WMULTI && mosi == 0xfd)   //stop tran token
+        {
+            mode = M_IDLE;
+            busy = 10;
+            return 0xff;
+        }
+    }
+
+    if (cmdIndex > 0 || (mosi & 0xc0) == 0x40)
+    {
+        cmdbuf[cmdIndex++] = mosi;
+        if (cmdIndex == 6)
+        {
+            cmdIndex = 0;
+            doCommand();
+        }
+        return 0xff;
+    }
+
+    if (queueEmpty() && mode == M_RMULTI && emu_clock_ok())
+        queueBlock(curBlock++);
+
+    if (!queueEmpty())
+        return dequeue();
+
+    return 0xff;
+}
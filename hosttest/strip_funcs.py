@@ -0,0 +1,13 @@
+# usage: strip_funcs.py file name...
+# removes the definitions of the named functions from a C file, so the
+# host versions in stubs.c take their place
+import sys,re
+p=sys.argv[1]; names=sys.argv[2:]; s=open(p).read()
+for n in names*4:
+    m=re.search(r'^[^\n;{}]*\b'+n+r'\s*\([^;{]*\)\s*\{', s, re.M)
+    if not m: continue
+    i=m.end(); depth=1
+    while depth: 
+        depth += {'{':1,'}':-1}.get(s[i],0); i+=1
+    s=s[:m.start()]+s[i:]
+open(p,'w').write(s)
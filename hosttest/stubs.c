@@ -0,0 +1,112 @@
+/*
+    stubs.c
+    host versions of the SPI byte and block transfers, talking to the card
+    emulated in sdemu.c, and of the UART output, shown with V=1
+*/
+#include <stdio.h>
+#include "avr/io.h"
+#include "SPI_routines.h"
+
+extern uint8_t emu_xfer(uint8_t mosi);
+extern int verbose;
+
+int emu_max_khz = 100000;   //the card fails transfers above this clock
+
+//SPI clock divider set in SPCR and SPSR
+int emu_divider(void)
+{
+    static const int divider[4] = {4, 16, 64, 128};
+    int d = divider[SPCR & 3];
+
+    if ((SPSR & (1<<SPI2X)) && (SPCR & 3) != 3)
+        d /= 2;
+
+    return d;
+}
+
+//1 if the card keeps up with the SPI clock at 8 MHz fosc
+int emu_clock_ok(void)
+{
+    return 8000 / emu_divider() <= emu_max_khz;
+}
+
+unsigned char SPI_transmit(unsigned char data)
+{
+    return emu_xfer(data);
+}
+
+unsigned char SPI_receive(void)
+{
+    return emu_xfer(0xff);
+}
+
+void SPI_transmitBlock(unsigned char *data, uint16_t count)
+{
+    while (count--)
+        emu_xfer(*data++);
+}
+
+void SPI_receiveBlock(unsigned char *data, uint16_t count)
+{
+    while (count--)
+        *data++ = emu_xfer(0xff);
+}
+
+//the sink gets each byte while the next one is clocked, like on the AVR
+void SPI_receiveToSink(byte_sink sink, uint16_t count)
+{
+    unsigned char in, next;
+
+    if (count == 0)
+        return;
+
+    in = emu_xfer(0xff);
+    while (--count)
+    {
+        next = emu_xfer(0xff);
+        sink(in);
+        in = next;
+    }
+    sink(in);
+}
+
+void SPI_transmitFromSource(byte_source source, uint16_t count)
+{
+    while (count--)
+        emu_xfer(source());
+}
+
+void uart0_init(unsigned int ubrr)
+{
+    (void)ubrr;
+}
+
+unsigned char receiveByte(void)
+{
+    return 0;
+}
+
+void transmitByte(unsigned char data)
+{
+    if (verbose)
+        fputc(data, stderr);
+}
+
+void transmitString_F(char *string)
+{
+    while (*string)
+        transmitByte(*string++);
+}
+
+void transmitString(unsigned char *string)
+{
+    while (*string)
+        transmitByte(*string++);
+}
+
+void transmitHex(unsigned char dataType, unsigned long data)
+{
+    (void)dataType;
+    if (verbose)
+        fprintf(stderr, "0x%lx", data);
+}
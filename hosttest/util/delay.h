@@ -0,0 +1,2 @@
+/* host stand-in for <util/delay.h>, the emulated card needs no delays */
+#define _delay_ms(x)
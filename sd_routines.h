@@ -26,11 +26,6 @@
 #ifndef _SD_ROUTINES_H_
 #define _SD_ROUTINES_H_
 
-//Use following macro if you don't want to activate the multiple block access functions
-//those functions are not required for FAT32
-
-#define FAT_TESTING_ONLY         
-
 //use following macros if PB1 pin is used for Chip Select of SD
 #define SD_CS_ASSERT     PORTB &= ~0x04
 #define SD_CS_DEASSERT   PORTB |= 0x04
@@ -45,6 +40,7 @@
 #define SET_BLOCK_LEN            16
 #define READ_SINGLE_BLOCK        17
 #define READ_MULTIPLE_BLOCKS     18
+#define SET_WR_BLK_ERASE_COUNT   23   //ACMD
 #define WRITE_SINGLE_BLOCK       24
 #define WRITE_MULTIPLE_BLOCKS    25
 #define ERASE_BLOCK_START_ADDR   32
@@ -59,15 +55,86 @@
 #define ON     1
 #define OFF    0
 
-volatile unsigned long _startBlock, _totalBlocks; 
-volatile unsigned char _SDHC_flag, _cardType, _buffer[512];
+//card parameters decoded from the CSD register
+typedef struct _card_info {
+    unsigned char csdVersion;     //0: CSD 1.0 (standard capacity), 1: CSD 2.0 (SDHC/SDXC)
+    unsigned long maxClockKHz;    //maximum data transfer rate (TRAN_SPEED)
+    unsigned long totalBlocks;    //capacity in 512 byte blocks
+    unsigned char spiDivider;     //SPI clock divider in use for this card
+} card_info;
+
+//multiple block transaction currently open on the card
+#define STREAM_NONE      0
+#define STREAM_READ      1
+#define STREAM_WRITE     2
+
+//states of a queued block request
+#define SD_REQ_PENDING      0   //waiting its turn on the card
+#define SD_REQ_WAIT_TOKEN   1   //read command sent, waiting for the data
+#define SD_REQ_PROGRAMMING  2   //write data accepted, card busy programming it
+#define SD_REQ_DONE         3
+#define SD_REQ_ERROR        4
+
+//number of requests that can be queued, a power of 2; 12 bytes of RAM
+//each. Two let a write be programmed while the next one is queued
+#ifndef SD_QUEUE_LENGTH
+#define SD_QUEUE_LENGTH     2
+#endif
+
+//queued single block read or write
+typedef struct _sd_request {
+    unsigned char handle;         //sequence number given out by SD_submitRead/SD_submitWrite
+    unsigned char state;
+    unsigned char write;
+    unsigned char response;       //error response when state is SD_REQ_ERROR
+    unsigned int retry;
+    unsigned long block;
+    unsigned char *buffer;
+} sd_request;
+
+//_startBlock is the next block of an open multiple block transaction,
+//_totalBlocks the blocks remaining in it (0 if open ended)
+volatile unsigned long _startBlock, _totalBlocks;
+volatile unsigned char _SDHC_flag, _cardType, _streamMode, _buffer[512];
+volatile card_info _cardInfo;
+volatile sd_request _sdQueue[SD_QUEUE_LENGTH];
+volatile unsigned char _sdQueueHead, _sdQueueTail;  //handles of the oldest and the next request
+
+//first failed request not collected by the time its slot was reused
+volatile unsigned char _sdErrorHandle, _sdErrorResponse, _sdErrorPending;
+
+//block last read into or written from _buffer, set it to NO_BLOCK after
+//using _buffer for anything else
+#define NO_BLOCK  0xffffffff
+volatile unsigned long _bufferBlock;
 
 unsigned char SD_init(void);
 unsigned char SD_sendCommand(unsigned char cmd, unsigned long arg);
+unsigned char SD_readCardInfo(void);
+unsigned char SD_slowDown(void);
 unsigned char SD_readSingleBlock(unsigned long startBlock);
+unsigned char SD_readBlockInto(unsigned long startBlock, unsigned char *buffer);
+unsigned char SD_readWindow(unsigned long startBlock, unsigned int offset, unsigned int length, unsigned char *buffer);
+unsigned char SD_waitStartToken(void);
 unsigned char SD_writeSingleBlock(unsigned long startBlock);
+unsigned char SD_writeBlockFrom(unsigned long startBlock, unsigned char *buffer);
 unsigned char SD_readMultipleBlock (unsigned long startBlock, unsigned long totalBlocks);
+unsigned char SD_readNextBlock(void);
+unsigned char SD_readNextBlockInto(unsigned char *buffer);
+unsigned char SD_readNextBlockToSink(byte_sink sink, unsigned int count);
+unsigned char SD_stopMultipleBlock(void);
 unsigned char SD_writeMultipleBlock(unsigned long startBlock, unsigned long totalBlocks);
+unsigned char SD_writeNextBlock(void);
+unsigned char SD_writeNextBlockFrom(unsigned char *buffer);
+unsigned char SD_writeNextBlockFromSource(byte_source source, unsigned int count);
+unsigned char SD_submitRequest(unsigned long startBlock, unsigned char *buffer, unsigned char write);
+unsigned char SD_submitRead(unsigned long startBlock, unsigned char *buffer);
+unsigned char SD_submitWrite(unsigned long startBlock, unsigned char *buffer);
+unsigned char SD_requestState(unsigned char handle);
+unsigned char SD_collectError(unsigned char handle);
+unsigned char SD_waitRequest(unsigned char handle);
+void SD_flushRequests(void);
+unsigned char SD_poll(void);
 unsigned char SD_erase (unsigned long startBlock, unsigned long totalBlocks);
 
 #endif